@@ -3,19 +3,26 @@
     {
       'target_name': 'gif',
       'sources': [
+        'src/adaptive_quantize.cpp',
         'src/animated_gif.cpp',
         'src/async_animated_gif.cpp',
         'src/common.cpp',
         'src/dynamic_gif_stack.cpp',
+        'src/encoder_context.cpp',
+        'src/encoder_thread.cpp',
+        'src/fragment_spool.cpp',
         'src/gif.cpp',
         'src/gif_encoder.cpp',
+        'src/lzw.cpp',
         'src/module.cpp',
         'src/palette.cpp',
+        'src/parallel.cpp',
         'src/quantize.cpp',
+        'src/quantize_simd.cpp',
         'src/utils.cpp'
       ],
       "include_dirs" : ["<!(node -p -e \"require('path').dirname(require.resolve('nan'))\")"],
-      "libraries": ["-lgif"],
+      "libraries": ["-lgif", "-lz"],
       'cflags_cc!': [ '-fno-exceptions' ],
       'conditions': [
           ['OS=="mac"', {
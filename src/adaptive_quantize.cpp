@@ -0,0 +1,282 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "adaptive_quantize.h"
+
+#define BIN(r, g, b) ((((r) >> 3) << 10) | (((g) >> 3) << 5) | ((b) >> 3))
+
+struct Box {
+    int lo[3], hi[3];
+    unsigned int count;
+};
+
+AdaptiveQuantizer::AdaptiveQuantizer() :
+    palette_size(0), transparent_idx(-1)
+{
+    hist = (Bin *)malloc(sizeof(*hist)*BINS);
+    inverse = (short *)malloc(sizeof(*inverse)*BINS);
+    inverse_dist = (int *)malloc(sizeof(*inverse_dist)*BINS);
+    if (!hist || !inverse || !inverse_dist) {
+        free(hist);
+        free(inverse);
+        free(inverse_dist);
+        throw "malloc in AdaptiveQuantizer::AdaptiveQuantizer failed";
+    }
+    reset();
+}
+
+AdaptiveQuantizer::~AdaptiveQuantizer()
+{
+    free(hist);
+    free(inverse);
+    free(inverse_dist);
+}
+
+void
+AdaptiveQuantizer::set_transparency_color(const Color &c)
+{
+    transparency_color = c;
+}
+
+void
+AdaptiveQuantizer::reset()
+{
+    memset(hist, 0, sizeof(*hist)*BINS);
+    memset(inverse, 0xff, sizeof(*inverse)*BINS);
+    palette_size = 0;
+    transparent_idx = -1;
+}
+
+void
+AdaptiveQuantizer::add(const unsigned char *data, int n, buffer_type buf_type)
+{
+    int bpp = bytes_per_pixel(buf_type);
+    int ri = 0, bi = 2;
+    if (buf_type == BUF_BGR || buf_type == BUF_BGRA) {
+        ri = 2;
+        bi = 0;
+    }
+    bool transparency = transparency_color.color_present;
+
+    for (int i = 0; i < n; i++, data += bpp) {
+        int r = data[ri], g = data[1], b = data[bi];
+        if (transparency && r == transparency_color.r &&
+            g == transparency_color.g && b == transparency_color.b)
+        {
+            continue;
+        }
+        Bin &bin = hist[BIN(r, g, b)];
+        bin.count++;
+        bin.r += r & 7;
+        bin.g += g & 7;
+        bin.b += b & 7;
+    }
+}
+
+static void
+shrink_box(Box &box, const unsigned int *counts)
+{
+    int lo[3] = { 32, 32, 32 }, hi[3] = { -1, -1, -1 };
+    box.count = 0;
+    for (int r = box.lo[0]; r <= box.hi[0]; r++) {
+        for (int g = box.lo[1]; g <= box.hi[1]; g++) {
+            for (int b = box.lo[2]; b <= box.hi[2]; b++) {
+                unsigned int count = counts[r << 10 | g << 5 | b];
+                if (!count) continue;
+                box.count += count;
+                int c[3] = { r, g, b };
+                for (int k = 0; k < 3; k++) {
+                    if (c[k] < lo[k]) lo[k] = c[k];
+                    if (c[k] > hi[k]) hi[k] = c[k];
+                }
+            }
+        }
+    }
+    if (box.count) {
+        memcpy(box.lo, lo, sizeof(lo));
+        memcpy(box.hi, hi, sizeof(hi));
+    }
+}
+
+static void
+split_box(Box &box, Box &other, const unsigned int *counts)
+{
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (box.hi[k] - box.lo[k] > box.hi[axis] - box.lo[axis])
+            axis = k;
+    }
+
+    unsigned int slices[32] = { 0 };
+    for (int r = box.lo[0]; r <= box.hi[0]; r++) {
+        for (int g = box.lo[1]; g <= box.hi[1]; g++) {
+            for (int b = box.lo[2]; b <= box.hi[2]; b++) {
+                int c[3] = { r, g, b };
+                slices[c[axis]] += counts[r << 10 | g << 5 | b];
+            }
+        }
+    }
+
+    // median plane, leaving at least one slice on both sides
+    int cut = box.lo[axis];
+    unsigned int sum = slices[cut];
+    while (cut < box.hi[axis] - 1 && sum < box.count/2)
+        sum += slices[++cut];
+
+    other = box;
+    box.hi[axis] = cut;
+    other.lo[axis] = cut + 1;
+    shrink_box(box, counts);
+    shrink_box(other, counts);
+}
+
+void
+AdaptiveQuantizer::bin_color(int bin, GifColorType &c) const
+{
+    const Bin &h = hist[bin];
+    int r = (bin >> 10) << 3, g = ((bin >> 5) & 31) << 3, b = (bin & 31) << 3;
+    if (h.count) {
+        c.Red = r + (h.r + h.count/2)/h.count;
+        c.Green = g + (h.g + h.count/2)/h.count;
+        c.Blue = b + (h.b + h.count/2)/h.count;
+    }
+    else {
+        c.Red = r + 4;
+        c.Green = g + 4;
+        c.Blue = b + 4;
+    }
+}
+
+int
+AdaptiveQuantizer::build_palette(int max_colors)
+{
+    bool transparency = transparency_color.color_present;
+    int max_boxes = transparency ? max_colors - 1 : max_colors;
+
+    unsigned int *counts = (unsigned int *)malloc(sizeof(*counts)*BINS);
+    if (!counts) throw "malloc in AdaptiveQuantizer::build_palette failed";
+    for (int i = 0; i < BINS; i++)
+        counts[i] = hist[i].count;
+
+    Box boxes[256];
+    int nboxes = 0;
+    Box &all = boxes[0];
+    for (int k = 0; k < 3; k++) {
+        all.lo[k] = 0;
+        all.hi[k] = 31;
+    }
+    shrink_box(all, counts);
+    if (all.count) nboxes = 1;
+
+    while (nboxes < max_boxes) {
+        // split the most populated box, weighted by its longest side
+        int best = -1;
+        unsigned long long best_score = 0;
+        for (int i = 0; i < nboxes; i++) {
+            int side = 0;
+            for (int k = 0; k < 3; k++) {
+                if (boxes[i].hi[k] - boxes[i].lo[k] > side)
+                    side = boxes[i].hi[k] - boxes[i].lo[k];
+            }
+            unsigned long long score = (unsigned long long)boxes[i].count*side;
+            if (score > best_score) {
+                best_score = score;
+                best = i;
+            }
+        }
+        if (best == -1) break; // every box is a single bin
+        split_box(boxes[best], boxes[nboxes++], counts);
+    }
+    free(counts);
+
+    for (int i = 0; i < nboxes; i++) {
+        unsigned long long count = 0, r = 0, g = 0, b = 0;
+        const Box &box = boxes[i];
+        for (int rr = box.lo[0]; rr <= box.hi[0]; rr++) {
+            for (int gg = box.lo[1]; gg <= box.hi[1]; gg++) {
+                for (int bb = box.lo[2]; bb <= box.hi[2]; bb++) {
+                    const Bin &h = hist[rr << 10 | gg << 5 | bb];
+                    if (!h.count) continue;
+                    count += h.count;
+                    r += (unsigned long long)(rr << 3)*h.count + h.r;
+                    g += (unsigned long long)(gg << 3)*h.count + h.g;
+                    b += (unsigned long long)(bb << 3)*h.count + h.b;
+                }
+            }
+        }
+        palette[i].Red = (r + count/2)/count;
+        palette[i].Green = (g + count/2)/count;
+        palette[i].Blue = (b + count/2)/count;
+    }
+
+    if (nboxes == 0) { // nothing but transparent pixels
+        palette[0].Red = palette[0].Green = palette[0].Blue = 0;
+        nboxes = 1;
+    }
+    palette_size = nboxes;
+
+    transparent_idx = -1;
+    if (transparency) {
+        transparent_idx = palette_size++;
+        palette[transparent_idx].Red = transparency_color.r;
+        palette[transparent_idx].Green = transparency_color.g;
+        palette[transparent_idx].Blue = transparency_color.b;
+    }
+    for (int i = palette_size; i < 256; i++)
+        palette[i].Red = palette[i].Green = palette[i].Blue = 0;
+
+    memset(inverse, 0xff, sizeof(*inverse)*BINS);
+    return palette_size;
+}
+
+int
+AdaptiveQuantizer::closest(int bin, int &dist) const
+{
+    GifColorType c;
+    bin_color(bin, c);
+
+    int idx = 0, best = -1;
+    for (int i = 0; i < palette_size; i++) {
+        if (i == transparent_idx) continue;
+        int dr = palette[i].Red - c.Red;
+        int dg = palette[i].Green - c.Green;
+        int db = palette[i].Blue - c.Blue;
+        int d = dr*dr + dg*dg + db*db;
+        if (best == -1 || d < best) {
+            best = d;
+            idx = i;
+        }
+    }
+    dist = best;
+    return idx;
+}
+
+unsigned long long
+AdaptiveQuantizer::map(const unsigned char *data, int n, buffer_type buf_type, GifByteType *out)
+{
+    unsigned long long error = 0;
+    int bpp = bytes_per_pixel(buf_type);
+    int ri = 0, bi = 2;
+    if (buf_type == BUF_BGR || buf_type == BUF_BGRA) {
+        ri = 2;
+        bi = 0;
+    }
+    bool transparency = transparent_idx >= 0;
+
+    for (int i = 0; i < n; i++, data += bpp) {
+        int r = data[ri], g = data[1], b = data[bi];
+        if (transparency && r == transparency_color.r &&
+            g == transparency_color.g && b == transparency_color.b)
+        {
+            *out++ = transparent_idx;
+            continue;
+        }
+        int bin = BIN(r, g, b);
+        if (inverse[bin] < 0)
+            inverse[bin] = closest(bin, inverse_dist[bin]);
+        *out++ = inverse[bin];
+        error += inverse_dist[bin];
+    }
+    return error;
+}
+
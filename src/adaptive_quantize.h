@@ -0,0 +1,57 @@
+#ifndef ADAPTIVE_QUANTIZE_H
+#define ADAPTIVE_QUANTIZE_H
+
+#include <gif_lib.h>
+
+#include "common.h"
+
+// Median cut quantizer over a 5 bits per channel histogram. Memory use is
+// fixed (32768 bins plus an inverse colormap of the same size) no matter how
+// many colors the image has.
+class AdaptiveQuantizer {
+public:
+    static const int BITS = 5;
+    static const int BINS = 1 << (3*BITS);
+
+private:
+    struct Bin {
+        // sums hold the low 3 bits of each channel, the bin index the rest
+        unsigned int count, r, g, b;
+    };
+
+    Bin *hist;
+    short *inverse;
+    int *inverse_dist; // squared distance of each bin to its palette color
+    GifColorType palette[256];
+    int palette_size;
+
+    Color transparency_color;
+    int transparent_idx;
+
+    void bin_color(int bin, GifColorType &c) const;
+    int closest(int bin, int &dist) const;
+
+public:
+    AdaptiveQuantizer();
+    ~AdaptiveQuantizer();
+
+    // Pixels of this color are left out of the histogram and mapped to
+    // a palette entry of their own.
+    void set_transparency_color(const Color &c);
+
+    void reset();
+    void add(const unsigned char *data, int n, buffer_type buf_type);
+    int build_palette(int max_colors=256);
+    // Returns the sum of squared errors, measured from bin means.
+    unsigned long long map(const unsigned char *data, int n, buffer_type buf_type, GifByteType *out);
+
+    const GifColorType *colors() const { return palette; }
+    int size() const { return palette_size; }
+    int transparent_index() const { return transparent_idx; }
+
+    // Bytes allocated, the same for every quantizer.
+    static size_t memory() { return BINS*(sizeof(Bin) + sizeof(short) + sizeof(int)); }
+};
+
+#endif
+
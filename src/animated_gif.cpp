@@ -1,4 +1,5 @@
 #include <cstdlib>
+#include <algorithm>
 
 #include "common.h"
 #include "gif_encoder.h"
@@ -22,30 +23,77 @@ AnimatedGif::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "end", End);
     NODE_SET_PROTOTYPE_METHOD(t, "setOutputFile", SetOutputFile);
     NODE_SET_PROTOTYPE_METHOD(t, "setOutputCallback", SetOutputCallback);
+    NODE_SET_PROTOTYPE_METHOD(t, "setPalette", SetPalette);
+    NODE_SET_PROTOTYPE_METHOD(t, "setDeltaTolerance", SetDeltaTolerance);
+    NODE_SET_PROTOTYPE_METHOD(t, "setPersistentCanvas", SetPersistentCanvas);
+    NODE_SET_PROTOTYPE_METHOD(t, "setDuplicateThreshold", SetDuplicateThreshold);
+    NODE_SET_PROTOTYPE_METHOD(t, "setBackgroundEncoding", SetBackgroundEncoding);
+    NODE_SET_PROTOTYPE_METHOD(t, "getStats", GetStats);
     target->Set(String::NewSymbol("AnimatedGif"), t->GetFunction());
 }
 
 AnimatedGif::AnimatedGif(int wwidth, int hheight, buffer_type bbuf_type) :
     width(wwidth), height(hheight), buf_type(bbuf_type),
     gif_encoder(wwidth, hheight, BUF_RGB), transparency_color(0xFF, 0xFF, 0xFE),
-    data(NULL), ondata(NULL)
+    data(NULL), pushed(false), persistent_canvas(false),
+    queue_size(0), encoder_thread(NULL), finish_queued(false),
+    chunk_size(DEFAULT_CHUNK_SIZE), async(NULL),
+    pending(NULL), pending_len(0), pending_size(0), ondata(NULL)
 {
     gif_encoder.set_transparency_color(transparency_color);
+    uv_mutex_init(&pending_mutex);
+}
+
+static void
+free_async(uv_handle_t *handle)
+{
+    delete (uv_async_t *)handle;
+}
+
+AnimatedGif::~AnimatedGif()
+{
+    delete encoder_thread; // waits for the frames still queued
+    if (async)
+        uv_close((uv_handle_t *)async, free_async);
+    free(pending);
+    uv_mutex_destroy(&pending_mutex);
+    if (ondata) {
+        delete ondata;
+    }
+    free(data);
+}
+
+void
+AnimatedGif::init_canvas()
+{
+    data = (unsigned char *)malloc(sizeof(*data)*width*height*3);
+    if (!data) throw "malloc in AnimatedGif::Push failed";
+
+    unsigned char *datap = data;
+    for (int i = 0; i < width*height; i++) {
+        *datap++ = transparency_color.r;
+        *datap++ = transparency_color.g;
+        *datap++ = transparency_color.b;
+    }
 }
 
 Handle<Value>
 AnimatedGif::Push(unsigned char *data_buf, int x, int y, int w, int h)
 {
-    if (!data) {
-        data = (unsigned char *)malloc(sizeof(*data)*width*height*3);
-        if (!data) throw "malloc in AnimatedGif::Push failed";
-
-        unsigned char *datap = data;
-        for (int i = 0; i < width*height; i++) {
-            *datap++ = transparency_color.r;
-            *datap++ = transparency_color.g;
-            *datap++ = transparency_color.b;
-        }
+    if (!data)
+        init_canvas();
+
+    if (!pushed) {
+        dirty = Rect(x, y, w, h);
+        pushed = true;
+    }
+    else {
+        int x1 = std::max(dirty.x + dirty.w, x + w);
+        int y1 = std::max(dirty.y + dirty.h, y + h);
+        dirty.x = std::min(dirty.x, x);
+        dirty.y = std::min(dirty.y, y);
+        dirty.w = x1 - dirty.x;
+        dirty.h = y1 - dirty.y;
     }
 
     int start = y*width*3 + x*3;
@@ -100,12 +148,220 @@ AnimatedGif::Push(unsigned char *data_buf, int x, int y, int w, int h)
     return Undefined();
 }
 
+bool
+AnimatedGif::EndPush(int delay)
+{
+    if (!data)
+        init_canvas();
+    Rect frame_dirty = pushed ? dirty : Rect(0, 0, 0, 0);
+
+    if (queue_size > 0) {
+        if (!encoder_thread)
+            start_background_encoding();
+        if (encoder_thread->full())
+            return false; // the frame stays open until there is room
+
+        // the thread frees the frame, a persistent canvas stays here
+        unsigned char *frame = data;
+        if (persistent_canvas) {
+            frame = (unsigned char *)malloc(sizeof(*frame)*width*height*3);
+            if (!frame) throw "malloc in AnimatedGif::EndPush failed";
+            memcpy(frame, data, width*height*3);
+        }
+        else {
+            data = NULL;
+        }
+        pushed = false;
+        encoder_thread->push(frame, delay, &frame_dirty);
+        return true;
+    }
+
+    pushed = false;
+    gif_encoder.new_frame(data, delay, &frame_dirty);
+    if (!persistent_canvas) {
+        free(data);
+        data = NULL;
+    }
+    if (ondata)
+        deliver_output();
+    return true;
+}
+
 void
-AnimatedGif::EndPush()
+AnimatedGif::start_background_encoding()
 {
-    gif_encoder.new_frame(data);
-    free(data);
-    data = NULL;
+    if (ondata) {
+        // giflib's writes come from the encoder thread, JS can only be
+        // called from this one
+        async = new uv_async_t;
+        uv_async_init(uv_default_loop(), async, output_ready);
+        async->data = this;
+        uv_unref((uv_handle_t *)async);
+    }
+    encoder_thread = new EncoderThread(gif_encoder, queue_size, ondata ? frame_written : NULL, this);
+}
+
+// Output function for the output callback. giflib writes a few bytes to a
+// sub-block at a time, calling into JS for each of those would cost more
+// than encoding, so writes are collected into chunks.
+int
+AnimatedGif::output_writer(GifFileType *gif_file, const GifByteType *data, int size)
+{
+    AnimatedGif *gif = (AnimatedGif *)gif_file->UserData;
+
+    uv_mutex_lock(&gif->pending_mutex);
+    if (gif->pending_len + size > gif->pending_size) {
+        int new_size = std::max(gif->pending_len + size, gif->chunk_size);
+        char *new_pending = (char *)realloc(gif->pending, new_size);
+        if (!new_pending) {
+            uv_mutex_unlock(&gif->pending_mutex);
+            return 0;
+        }
+        gif->pending = new_pending;
+        gif->pending_size = new_size;
+    }
+    memcpy(gif->pending + gif->pending_len, data, size);
+    gif->pending_len += size;
+    bool full = gif->pending_len >= gif->chunk_size && gif->pending_len - size < gif->chunk_size;
+    uv_mutex_unlock(&gif->pending_mutex);
+
+    if (full) {
+        if (gif->encoder_thread)
+            uv_async_send(gif->async);
+        else
+            gif->deliver_output();
+    }
+    return size;
+}
+
+// Called by the encoder thread once a frame is written out.
+void
+AnimatedGif::frame_written(void *arg)
+{
+    AnimatedGif *gif = (AnimatedGif *)arg;
+    uv_mutex_lock(&gif->pending_mutex);
+    bool any = gif->pending_len > 0;
+    uv_mutex_unlock(&gif->pending_mutex);
+    if (any)
+        uv_async_send(gif->async);
+}
+
+void
+AnimatedGif::output_ready(uv_async_t *handle, int status)
+{
+    ((AnimatedGif *)handle->data)->deliver_output();
+}
+
+// Hands the output collected so far to the output callback, the chunk
+// becomes the Buffer.
+void
+AnimatedGif::deliver_output()
+{
+    uv_mutex_lock(&pending_mutex);
+    char *chunk = pending;
+    int len = pending_len;
+    pending = NULL;
+    pending_len = pending_size = 0;
+    uv_mutex_unlock(&pending_mutex);
+
+    if (!len) {
+        free(chunk);
+        return;
+    }
+
+    NanScope();
+    Local<Value> argv[1] = {NanNewBufferHandle(chunk, len, free_buffer_data, NULL)};
+    ondata->Call(1, argv);
+}
+
+void
+AnimatedGif::finish()
+{
+    if (encoder_thread)
+        encoder_thread->finish();
+    else
+        gif_encoder.finish();
+    if (ondata)
+        deliver_output();
+}
+
+// The encoder's output becomes the Buffer, which is kept for later calls.
+Local<Value>
+AnimatedGif::GifBuffer()
+{
+    Local<String> key = String::New("gif");
+    int gif_len = gif_encoder.get_gif_len();
+    if (gif_len == 0) {
+        Local<Value> retbuf = NanObjectWrapHandle(this)->GetHiddenValue(key);
+        if (!retbuf.IsEmpty())
+            return retbuf;
+    }
+    Local<Object> retbuf = gif_len ?
+        NanNewBufferHandle((char *)gif_encoder.release_gif(), gif_len, free_buffer_data, NULL) :
+        NanNewBufferHandle(0);
+    NanObjectWrapHandle(this)->SetHiddenValue(key, retbuf);
+    return retbuf;
+}
+
+void
+AnimatedGif::FinishWorker::Execute()
+{
+    try {
+        gif_obj->encoder_thread->finish();
+    }
+    catch (const char *err) {
+        errmsg = strdup(err);
+    }
+}
+
+void
+AnimatedGif::FinishWorker::HandleOKCallback()
+{
+    NanScope();
+
+    gif_obj->finish_queued = false; // the callback may ask for the gif again
+
+    if (gif_obj->ondata)
+        gif_obj->deliver_output();
+
+    Local<Value> argv[2] = {Undefined(), Undefined()};
+    if (want_gif)
+        argv[0] = gif_obj->GifBuffer();
+
+    TryCatch try_catch; // don't quite see the necessity of this
+
+    callback->Call(want_gif ? 2 : 1, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    gif_obj->Unref();
+}
+
+void
+AnimatedGif::FinishWorker::HandleErrorCallback()
+{
+    NanScope();
+
+    gif_obj->finish_queued = false; // the callback may ask for the gif again
+
+    if (gif_obj->ondata)
+        gif_obj->deliver_output();
+
+    Local<Value> error = Exception::Error(String::New(errmsg));
+    Local<Value> argv[2] = {Undefined(), error};
+
+    TryCatch try_catch; // don't quite see the necessity of this
+
+    if (want_gif)
+        callback->Call(2, argv);
+    else
+        callback->Call(1, &error);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    gif_obj->Unref();
 }
 
 NAN_METHOD(AnimatedGif::New)
@@ -146,10 +402,10 @@ NAN_METHOD(AnimatedGif::New)
     int w = args[0]->Int32Value();
     int h = args[1]->Int32Value();
 
-    if (w < 0)
-        return NanThrowRangeError("Width smaller than 0.");
-    if (h < 0)
-        return NanThrowRangeError("Height smaller than 0.");
+    if (w < 1)
+        return NanThrowRangeError("Width smaller than 1.");
+    if (h < 1)
+        return NanThrowRangeError("Height smaller than 1.");
 
     AnimatedGif *gif = new AnimatedGif(w, h, buf_type);
     gif->Wrap(args.This());
@@ -210,15 +466,27 @@ NAN_METHOD(AnimatedGif::EndPush)
 {
     NanScope();
 
+    int delay = 0;
+    if (args.Length() > 0) {
+        if (!args[0]->IsInt32())
+            return NanThrowTypeError("First argument must be integer delay.");
+        delay = args[0]->Int32Value();
+        if (delay < 0)
+            return NanThrowRangeError("Delay smaller than 0.");
+        if (delay > 0xffff)
+            return NanThrowRangeError("Delay greater than 65535.");
+    }
+
+    bool taken;
     try {
         AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
-        gif->EndPush();
+        taken = gif->EndPush(delay);
     }
     catch (const char *err) {
         return NanThrowError(err);
     }
 
-    NanReturnUndefined();
+    NanReturnValue(Boolean::New(taken));
 }
 
 NAN_METHOD(AnimatedGif::GetGif)
@@ -226,10 +494,33 @@ NAN_METHOD(AnimatedGif::GetGif)
     NanScope();
 
     AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
-    gif->gif_encoder.finish();
-    int gif_len = gif->gif_encoder.get_gif_len();
-    Local<Object> retbuf = NanNewBufferHandle(gif_len);
-    memcpy(Buffer::Data(retbuf), gif->gif_encoder.get_gif(), gif_len);
+    if (gif->finish_queued)
+        return NanThrowError("Already finishing in the background.");
+    if (args.Length() > 0) {
+        if (!args[0]->IsFunction())
+            return NanThrowTypeError("First argument must be a function.");
+        if (gif->encoder_thread) {
+            Local<Function> callback = Local<Function>::Cast(args[0]);
+            NanAsyncQueueWorker(new AnimatedGif::FinishWorker(new NanCallback(callback), gif, true));
+            gif->finish_queued = true;
+            gif->Ref();
+            NanReturnUndefined();
+        }
+    }
+
+    try {
+        gif->finish();
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    Local<Value> retbuf = gif->GifBuffer();
+    if (args.Length() > 0) {
+        Local<Value> argv[2] = {retbuf, Undefined()};
+        Local<Function>::Cast(args[0])->Call(Context::GetCurrent()->Global(), 2, argv);
+        NanReturnUndefined();
+    }
     NanReturnValue(retbuf);
 }
 
@@ -238,8 +529,31 @@ NAN_METHOD(AnimatedGif::End)
     NanScope();
 
     AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
-    gif->gif_encoder.finish();
+    if (gif->finish_queued)
+        return NanThrowError("Already finishing in the background.");
+    if (args.Length() > 0) {
+        if (!args[0]->IsFunction())
+            return NanThrowTypeError("First argument must be a function.");
+        if (gif->encoder_thread) {
+            Local<Function> callback = Local<Function>::Cast(args[0]);
+            NanAsyncQueueWorker(new AnimatedGif::FinishWorker(new NanCallback(callback), gif, false));
+            gif->finish_queued = true;
+            gif->Ref();
+            NanReturnUndefined();
+        }
+    }
+
+    try {
+        gif->finish();
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
 
+    if (args.Length() > 0) {
+        Local<Value> argv[1] = {Undefined()};
+        Local<Function>::Cast(args[0])->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
     NanReturnUndefined();
 }
 
@@ -256,40 +570,182 @@ NAN_METHOD(AnimatedGif::SetOutputFile)
     String::AsciiValue file_name(args[0]->ToString());
 
     AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->encoder_thread)
+        return NanThrowError("Output file can't be changed once frames are encoded in the background.");
     gif->gif_encoder.set_output_file(*file_name);
 
     NanReturnUndefined();
 }
 
-int
-stream_writer(GifFileType *gif_file, const GifByteType *data, int size)
-{
-    NanScope();
-
-    AnimatedGif *gif = (AnimatedGif *)gif_file->UserData;
-    Local<Object> retbuf = NanNewBufferHandle(size);
-    memcpy(Buffer::Data(retbuf), data, size);
-    Local<Value> argv[1] = {retbuf};
-    gif->ondata->Call(1, argv);
-    return size;
-}
-
 NAN_METHOD(AnimatedGif::SetOutputCallback)
 {
     NanScope();
 
-    if (args.Length() != 1)
-        return NanThrowError("One argument required - path to output file.");
+    if (args.Length() < 1)
+        return NanThrowError("At least one argument required - output callback, [chunk size].");
 
     if (!args[0]->IsFunction())
-        return NanThrowTypeError("First argument must be string.");
+        return NanThrowTypeError("First argument must be a function.");
+
+    int chunk_size = DEFAULT_CHUNK_SIZE;
+    if (args.Length() > 1) {
+        if (!args[1]->IsInt32())
+            return NanThrowTypeError("Second argument must be integer chunk size.");
+        chunk_size = args[1]->Int32Value();
+        if (chunk_size < 1)
+            return NanThrowRangeError("Chunk size smaller than 1.");
+    }
 
     Local<Function> callback = Local<Function>::Cast(args[0]);
     AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->encoder_thread)
+        return NanThrowError("Output callback can't be changed after the first frame.");
     if (gif->ondata) {
         delete gif->ondata;
     }
     gif->ondata = new NanCallback(callback);
-    gif->gif_encoder.set_output_func(stream_writer, (void*)gif);
+    gif->chunk_size = chunk_size;
+    gif->gif_encoder.set_output_func(output_writer, (void*)gif);
+    NanReturnUndefined();
+}
+
+NAN_METHOD(AnimatedGif::SetPalette)
+{
+    NanScope();
+
+    if (args.Length() < 1)
+        return NanThrowError("At least one argument required - 'websafe', 'adaptive' or 'global', [sample frames, max error].");
+    if (!args[0]->IsString())
+        return NanThrowTypeError("First argument must be 'websafe', 'adaptive' or 'global'.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->encoder_thread)
+        return NanThrowError("Palette can't be changed once frames are encoded in the background.");
+
+    String::AsciiValue name(args[0]->ToString());
+    if (str_eq(*name, "websafe"))
+        gif->gif_encoder.set_palette(PALETTE_WEB_SAFE);
+    else if (str_eq(*name, "adaptive"))
+        gif->gif_encoder.set_palette(PALETTE_ADAPTIVE);
+    else if (str_eq(*name, "global")) {
+        int sample_frames = 1;
+        int max_error = AnimatedGifEncoder::DEFAULT_MAX_ERROR;
+        if (args.Length() > 1) {
+            if (!args[1]->IsInt32())
+                return NanThrowTypeError("Second argument must be integer sample frames.");
+            sample_frames = args[1]->Int32Value();
+            if (sample_frames < 1)
+                return NanThrowRangeError("Sample frames smaller than 1.");
+        }
+        if (args.Length() > 2) {
+            if (!args[2]->IsInt32())
+                return NanThrowTypeError("Third argument must be integer max error.");
+            max_error = args[2]->Int32Value();
+            if (max_error < 0)
+                return NanThrowRangeError("Max error smaller than 0.");
+        }
+        gif->gif_encoder.set_global_palette(sample_frames, max_error);
+    }
+    else
+        return NanThrowTypeError("First argument must be 'websafe', 'adaptive' or 'global'.");
+
     NanReturnUndefined();
 }
+
+NAN_METHOD(AnimatedGif::SetDeltaTolerance)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - tolerance.");
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer tolerance.");
+
+    int tolerance = args[0]->Int32Value();
+    if (tolerance > 255)
+        return NanThrowRangeError("Tolerance greater than 255.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->encoder_thread)
+        return NanThrowError("Delta tolerance can't be changed once frames are encoded in the background.");
+    gif->gif_encoder.set_delta_tolerance(tolerance < 0 ? -1 : tolerance);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(AnimatedGif::SetDuplicateThreshold)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - changed pixels threshold.");
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer threshold.");
+
+    int threshold = args[0]->Int32Value();
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->encoder_thread)
+        return NanThrowError("Duplicate threshold can't be changed once frames are encoded in the background.");
+    gif->gif_encoder.set_duplicate_threshold(threshold < 0 ? -1 : threshold);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(AnimatedGif::SetPersistentCanvas)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - true or false.");
+    if (!args[0]->IsBoolean())
+        return NanThrowTypeError("First argument must be boolean.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->encoder_thread)
+        return NanThrowError("Persistent canvas can't be changed once frames are encoded in the background.");
+    gif->persistent_canvas = args[0]->BooleanValue();
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(AnimatedGif::SetBackgroundEncoding)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - queue size.");
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer queue size.");
+
+    int queue_size = args[0]->Int32Value();
+    if (queue_size < 0)
+        return NanThrowRangeError("Queue size smaller than 0.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->encoder_thread)
+        return NanThrowError("Background encoding can't be changed after the first frame.");
+    gif->queue_size = queue_size;
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(AnimatedGif::GetStats)
+{
+    NanScope();
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    // the encoder thread has a copy, the encoder itself may be busy
+    EncoderStats stats = gif->encoder_thread ?
+        gif->encoder_thread->get_stats() : gif->gif_encoder.get_stats();
+
+    Local<Object> ret = Object::New();
+    ret->Set(String::NewSymbol("frames"), Integer::New(stats.frames));
+    ret->Set(String::NewSymbol("localColorTables"), Integer::New(stats.local_color_tables));
+    ret->Set(String::NewSymbol("croppedFrames"), Integer::New(stats.cropped_frames));
+    ret->Set(String::NewSymbol("unchangedPixels"), Number::New(stats.unchanged_pixels));
+    ret->Set(String::NewSymbol("elidedFrames"), Integer::New(stats.elided_frames));
+    ret->Set(String::NewSymbol("outputAllocs"), Integer::New(stats.output_allocs));
+    ret->Set(String::NewSymbol("outputBytesCopied"), Number::New(stats.output_bytes_copied));
+
+    NanReturnValue(ret);
+}
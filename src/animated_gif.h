@@ -5,6 +5,7 @@
 #include <node_buffer.h>
 
 #include "gif_encoder.h"
+#include "encoder_thread.h"
 #include "common.h"
 
 class AnimatedGif : public node::ObjectWrap {
@@ -14,21 +15,64 @@ class AnimatedGif : public node::ObjectWrap {
     AnimatedGifEncoder gif_encoder;
     Color transparency_color;
     unsigned char *data;
+    Rect dirty; // union of the rects pushed since the last endPush
+    bool pushed;
+
+    // keep data between frames so what wasn't pushed carries over
+    bool persistent_canvas;
+
+    // setBackgroundEncoding: frames are encoded by encoder_thread, with up
+    // to queue_size of them waiting.
+    int queue_size;
+    EncoderThread *encoder_thread;
+    bool finish_queued; // a FinishWorker hasn't called back yet
+
+    // Output for the output callback is collected in pending and handed
+    // over, on the main thread, once chunk_size bytes are there or a frame
+    // is done. The encoder thread asks for that through async.
+    int chunk_size;
+    uv_async_t *async;
+    uv_mutex_t pending_mutex;
+    char *pending;
+    int pending_len, pending_size;
+
+    void init_canvas();
+    void start_background_encoding();
+    static int output_writer(GifFileType *gif_file, const GifByteType *data, int size);
+    static void frame_written(void *arg);
+    static void output_ready(uv_async_t *handle, int status);
+    void deliver_output();
+    void finish();
+    v8::Local<v8::Value> GifBuffer();
 
 public:
+    static const int DEFAULT_CHUNK_SIZE = 64*1024;
+
     NanCallback *ondata;
 
     static void Initialize(v8::Handle<v8::Object> target);
 
     AnimatedGif(int wwidth, int hheight, buffer_type bbuf_type);
+    ~AnimatedGif();
     v8::Handle<v8::Value> Push(unsigned char *data_buf, int x, int y, int w, int h);
-    void EndPush();
+    // Closes the frame, delay in 1/100s of a second. Returns false, the
+    // frame left open, when the background queue is full.
+    bool EndPush(int delay=0);
+
+    // end() and getGif() with a callback, when encoding in the background
+    class FinishWorker : public NanAsyncWorker {
+    public:
+        FinishWorker(NanCallback *callback, AnimatedGif *gif, bool wwant_gif) :
+            NanAsyncWorker(callback), gif_obj(gif), want_gif(wwant_gif) {}
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
 
-    ~AnimatedGif() {
-        if (ondata) {
-            delete ondata;
-        }
-    }
+    private:
+        AnimatedGif *gif_obj;
+        bool want_gif;
+    };
 
     static NAN_METHOD(New);
     static NAN_METHOD(Push);
@@ -37,6 +81,12 @@ public:
     static NAN_METHOD(GetGif);
     static NAN_METHOD(SetOutputFile);
     static NAN_METHOD(SetOutputCallback);
+    static NAN_METHOD(SetPalette);
+    static NAN_METHOD(SetDeltaTolerance);
+    static NAN_METHOD(SetPersistentCanvas);
+    static NAN_METHOD(SetDuplicateThreshold);
+    static NAN_METHOD(SetBackgroundEncoding);
+    static NAN_METHOD(GetStats);
 };
 
 #endif
@@ -1,8 +1,9 @@
+#include <algorithm>
 #include <cerrno>
 #include <cstdlib>
+#include <cstring>
 
 #include "common.h"
-#include "utils.h"
 #include "gif_encoder.h"
 #include "async_animated_gif.h"
 
@@ -21,49 +22,99 @@ AsyncAnimatedGif::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "encode", Encode);
     NODE_SET_PROTOTYPE_METHOD(t, "setOutputFile", SetOutputFile);
     NODE_SET_PROTOTYPE_METHOD(t, "setTmpDir", SetTmpDir);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMemoryBudget", SetMemoryBudget);
+    NODE_SET_PROTOTYPE_METHOD(t, "setCompression", SetCompression);
+    NODE_SET_PROTOTYPE_METHOD(t, "setParallelFrames", SetParallelFrames);
+    NODE_SET_PROTOTYPE_METHOD(t, "getSpoolStats", GetSpoolStats);
     target->Set(String::NewSymbol("AsyncAnimatedGif"), t->GetFunction());
 }
 
 AsyncAnimatedGif::AsyncAnimatedGif(int wwidth, int hheight, buffer_type bbuf_type) :
     width(wwidth), height(hheight), buf_type(bbuf_type),
     transparency_color(0xFF, 0xFF, 0xFE),
-    push_id(0), fragment_id(0) {}
+    push_id(0), fragment_id(0), spool(bbuf_type),
+    pending_writes(0), parallel_frames(1), frames_started(0), slots_busy(0), preparing(0),
+    writing(false), finishing(false), encoder(NULL), error_msg(NULL), encode_callback(NULL) {}
 
-void PushWorker::Execute() {
-    char fragment_dir[512];
-    snprintf(fragment_dir, 512, "%s/%d", tmp_dir, push_id);
+AsyncAnimatedGif::~AsyncAnimatedGif()
+{
+    for (size_t i = 0; i < slots.size(); i++)
+        delete slots[i];
+    for (size_t i = 0; i < idle_slots.size(); i++)
+        delete idle_slots[i];
+    delete encoder;
+    free(error_msg);
+    delete encode_callback;
+}
 
-    if (!is_dir(fragment_dir)) {
-        if (mkdir(fragment_dir, 0775) == -1) {
-            fprintf(stderr, "Could not mkdir(%s) in PushWorker::Execute().\n",
-                fragment_dir);
-            return;
-        }
+void
+AsyncAnimatedGif::SpoolStoreWorker::Execute()
+{
+    try {
+        gif_obj->spool.store(batch);
+    }
+    catch (const char *err) {
+        errmsg = strdup(err);
     }
+}
 
-    char filename[512];
-    snprintf(filename, 512, "%s/%d/rect-%d-%d-%d-%d-%d.dat",
-        tmp_dir, push_id, fragment_id,
-        x, y, w, h);
-    FILE *out = fopen(filename, "w+");
-    if (!out) {
-        fprintf(stderr, "Failed to open %s in PushWorker::Execute().\n",
-            filename);
-        return;
+void
+AsyncAnimatedGif::SpoolStoreWorker::HandleOKCallback()
+{
+    gif_obj->write_done(batch, NULL);
+}
+
+void
+AsyncAnimatedGif::SpoolStoreWorker::HandleErrorCallback()
+{
+    gif_obj->write_done(batch, errmsg);
+}
+
+void
+AsyncAnimatedGif::FrameEncodeWorker::Execute()
+{
+    try {
+        gif_obj->encode_frame(slot);
     }
-    int written = fwrite(data, sizeof(unsigned char), data_size, out);
-    if (written != data_size) {
-        fprintf(stderr, "Failed to write all data to %s. Wrote only %d of %d.\n",
-            filename, written, data_size);
+    catch (const char *err) {
+        errmsg = strdup(err);
     }
+}
 
-    fclose(out);
+void
+AsyncAnimatedGif::FrameEncodeWorker::HandleOKCallback()
+{
+    gif_obj->frame_done(slot, NULL);
 }
 
-void PushWorker::HandleOKCallback() {
+void
+AsyncAnimatedGif::FrameEncodeWorker::HandleErrorCallback()
+{
+    gif_obj->frame_done(slot, errmsg);
 }
 
-void PushWorker::HandleErrorCallback() {
+void
+AsyncAnimatedGif::FrameWriteWorker::Execute()
+{
+    try {
+        for (size_t i = 0; i < written.size(); i++)
+            gif_obj->encoder->put_indexed_frame(written[i]->indexed);
+    }
+    catch (const char *err) {
+        errmsg = strdup(err);
+    }
+}
+
+void
+AsyncAnimatedGif::FrameWriteWorker::HandleOKCallback()
+{
+    gif_obj->frames_written(written, NULL);
+}
+
+void
+AsyncAnimatedGif::FrameWriteWorker::HandleErrorCallback()
+{
+    gif_obj->frames_written(written, errmsg);
 }
 
 Handle<Value>
@@ -71,23 +122,223 @@ AsyncAnimatedGif::Push(unsigned char *data_buf, int x, int y, int w, int h)
 {
     NanScope();
 
-    if (tmp_dir.empty())
-        throw "Tmp dir is not set. Use .setTmpDir to set it before pushing.";
-
     if (output_file.empty())
         throw "Output file is not set. Use .setOutputFile to set it before pushing.";
+    if (encode_callback || finishing)
+        throw "Can't push once encode was called.";
 
-    NanAsyncQueueWorker(new PushWorker(push_id, fragment_id++, tmp_dir.c_str(), data_buf, x, y, w, h));
+    spool.append(push_id, Rect(x, y, w, h), data_buf, w*h*bytes_per_pixel(buf_type));
+    fragment_id++;
+    if (spool.batch_full())
+        write_batch();
 
     return scope.Close(Undefined());
 }
 
-
 void
 AsyncAnimatedGif::EndPush()
 {
+    // A batch never holds fragments of two frames, so the frame can be
+    // encoded once the batches up to here are stored.
+    write_batch();
+    frames.push_back(std::vector<SpoolFragment>());
+    spool.take_fragments(frames.back());
     push_id++;
     fragment_id = 0;
+    encode_next_frame();
+}
+
+// Hands the batch of fragments collected so far to a worker to store.
+void
+AsyncAnimatedGif::write_batch()
+{
+    if (spool.batch_empty())
+        return;
+    NanAsyncQueueWorker(new SpoolStoreWorker(this, spool.seal_batch()));
+    pending_writes++;
+    Ref();
+}
+
+void
+AsyncAnimatedGif::write_done(SpoolBatch *batch, const char *error)
+{
+    if (error)
+        set_error(error);
+    else
+        batch->stored = true;
+    pending_writes--;
+    encode_next_frame();
+    finish_encode();
+    Unref();
+}
+
+void
+AsyncAnimatedGif::set_error(const char *error)
+{
+    if (!error_msg)
+        error_msg = strdup(error);
+}
+
+// The encoder is made once the first frame is ready, the output file must
+// be set by then.
+void
+AsyncAnimatedGif::make_encoder()
+{
+    if (encoder)
+        return;
+    encoder = new AnimatedGifEncoder(width, height, BUF_RGB);
+    encoder->set_output_file(output_file.c_str());
+    encoder->set_transparency_color(transparency_color);
+}
+
+AsyncAnimatedGif::FrameSlot *
+AsyncAnimatedGif::get_slot()
+{
+    FrameSlot *slot;
+    if (!idle_slots.empty()) {
+        slot = idle_slots.back();
+        idle_slots.pop_back();
+        return slot;
+    }
+    slot = new FrameSlot();
+    slot->frame = (GifByteType *)malloc(width*height);
+    if (!slot->frame) {
+        delete slot;
+        set_error("malloc failed in AsyncAnimatedGif::get_slot().");
+        return NULL;
+    }
+    return slot;
+}
+
+// Starts on the oldest closed frames whose fragments are all stored, while
+// fewer than parallel_frames are on their way out. Nothing is started
+// after an error.
+void
+AsyncAnimatedGif::encode_next_frame()
+{
+    while (!finishing && !error_msg && !frames.empty() && slots_busy < parallel_frames) {
+        std::vector<SpoolFragment> &next = frames.front();
+        for (size_t i = 0; i < next.size(); i++) {
+            if (!next[i].batch->stored)
+                return;
+        }
+        make_encoder();
+        FrameSlot *slot = get_slot();
+        if (!slot)
+            return;
+
+        slot->fragments.swap(next);
+        frames.pop_front();
+        slot->first = frames_started++ == 0;
+        slot->done = false;
+        slots.push_back(slot);
+        slots_busy++;
+        preparing++;
+        NanAsyncQueueWorker(new FrameEncodeWorker(this, slot));
+        Ref();
+    }
+}
+
+// Runs on the FrameEncodeWorker's thread. Fragments are already web safe
+// palette indices, the frame is put together from them and only needs
+// cropping and compressing.
+void
+AsyncAnimatedGif::encode_frame(FrameSlot *slot)
+{
+    const std::vector<SpoolFragment> &fragments = slot->fragments;
+    memset(slot->frame, encoder->web_safe_transparent_index(), width*height);
+
+    Rect dirty(0, 0, 0, 0);
+    for (size_t i = 0; i < fragments.size(); i++) {
+        const GifByteType *data = spool.read(fragments[i], slot->read_buf);
+        if (!data)
+            throw "Failed to read fragments from the spool in AsyncAnimatedGif::encode_frame().";
+        const Rect &r = fragments[i].rect;
+        push_fragment(slot->frame, width, data, r);
+        if (dirty.w == 0 || dirty.h == 0) {
+            dirty = r;
+        }
+        else {
+            int x1 = std::max(dirty.x + dirty.w, r.x + r.w);
+            int y1 = std::max(dirty.y + dirty.h, r.y + r.h);
+            dirty.x = std::min(dirty.x, r.x);
+            dirty.y = std::min(dirty.y, r.y);
+            dirty.w = x1 - dirty.x;
+            dirty.h = y1 - dirty.y;
+        }
+    }
+    encoder->prepare_indexed_frame(slot->frame, &dirty, slot->first, slot->indexed);
+}
+
+void
+AsyncAnimatedGif::frame_done(FrameSlot *slot, const char *error)
+{
+    if (error)
+        set_error(error);
+    for (size_t i = 0; i < slot->fragments.size(); i++) {
+        if (!slot->fragments[i].batch->released)
+            spool.release(slot->fragments[i].batch);
+    }
+    slot->fragments.clear();
+    slot->done = true;
+    preparing--;
+    write_frames();
+    encode_next_frame();
+    finish_encode();
+    Unref();
+}
+
+// Hands the prepared frames that are next in push order to a worker to
+// write, unless one is writing already.
+void
+AsyncAnimatedGif::write_frames()
+{
+    if (writing || error_msg)
+        return;
+    std::vector<FrameSlot *> written;
+    while (!slots.empty() && slots.front()->done) {
+        written.push_back(slots.front());
+        slots.pop_front();
+    }
+    if (written.empty())
+        return;
+    NanAsyncQueueWorker(new FrameWriteWorker(this, written));
+    writing = true;
+    Ref();
+}
+
+void
+AsyncAnimatedGif::frames_written(const std::vector<FrameSlot *> &written, const char *error)
+{
+    if (error)
+        set_error(error);
+    for (size_t i = 0; i < written.size(); i++)
+        idle_slots.push_back(written[i]);
+    slots_busy -= written.size();
+    writing = false;
+    write_frames();
+    encode_next_frame();
+    finish_encode();
+    Unref();
+}
+
+// Once encode was called and every closed frame is written, or an error
+// stopped the encoding, the encode worker finishes the gif.
+void
+AsyncAnimatedGif::finish_encode()
+{
+    if (!encode_callback || pending_writes > 0 || preparing > 0 || writing)
+        return;
+    if (!error_msg && (!frames.empty() || !slots.empty()))
+        return;
+    if (!frames_started)
+        set_error("No frames to encode. Use .endPush to close the frames pushed.");
+    if (!error_msg)
+        make_encoder();
+
+    finishing = true;
+    NanAsyncQueueWorker(new AsyncAnimatedGif::AnimatedGifEncodeWorker(encode_callback, this));
+    encode_callback = NULL;
 }
 
 NAN_METHOD(AsyncAnimatedGif::New)
@@ -192,173 +443,36 @@ NAN_METHOD(AsyncAnimatedGif::EndPush)
     NanScope();
 
     AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    if (gif->encode_callback || gif->finishing)
+        return NanThrowError("Can't push once encode was called.");
     gif->EndPush();
 
     NanReturnUndefined();
 }
 
-int
-fragment_sort(const void *aa, const void *bb)
-{
-    const char *a = *(const char **)aa;
-    const char *b = *(const char **)bb;
-    int na, nb;
-    sscanf(a, "rect-%d", &na);
-    sscanf(b, "rect-%d", &nb);
-    return na > nb;
-}
-
-unsigned char *
-AsyncAnimatedGif::init_frame(int width, int height, Color &transparency_color)
-{
-    unsigned char *frame = (unsigned char *)malloc(sizeof(*frame)*width*height*3);
-    if (!frame) return NULL;
-
-    unsigned char *framgep = frame;
-    for (int i = 0; i < width*height; i++) {
-        *framgep++ = transparency_color.r;
-        *framgep++ = transparency_color.g;
-        *framgep++ = transparency_color.b;
-    }
-
-    return frame;
-}
-
 void
-AsyncAnimatedGif::push_fragment(unsigned char *frame, int width, int height,
-    buffer_type buf_type, unsigned char *fragment, int x, int y, int w, int h)
-{
-    int start = y*width*3 + x*3;
-
-    switch (buf_type) {
-    case BUF_RGB:
-        for (int i = 0; i < h; i++) {
-            unsigned char *framep = &frame[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *framep++ = *fragment++;
-                *framep++ = *fragment++;
-                *framep++ = *fragment++;
-            }
-        }
-        break;
-    case BUF_BGR:
-        for (int i = 0; i < h; i++) {
-            unsigned char *framep = &frame[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *framep++ = *(fragment + 2);
-                *framep++ = *(fragment + 1);
-                *framep++ = *fragment;
-                framep += 3;
-            }
-        }
-        break;
-    case BUF_RGBA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *framep = &frame[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *framep++ = *fragment++;
-                *framep++ = *fragment++;
-                *framep++ = *fragment++;
-                fragment++;
-            }
-        }
-        break;
-    case BUF_BGRA:
-        for (int i = 0; i < h; i++) {
-            unsigned char *framep = &frame[start + i*width*3];
-            for (int j = 0; j < w; j++) {
-                *framep++ = *(fragment + 2);
-                *framep++ = *(fragment + 1);
-                *framep++ = *fragment;
-                framep += 4;
-            }
-        }
-        break;
-    }
-}
-
-Rect
-AsyncAnimatedGif::rect_dims(const char *fragment_name)
+AsyncAnimatedGif::push_fragment(GifByteType *frame, int width, const GifByteType *fragment,
+    const Rect &rect)
 {
-    int moo, x, y, w, h;
-    sscanf(fragment_name, "rect-%d-%d-%d-%d-%d", &moo, &x, &y, &w, &h);
-    return Rect(x, y, w, h);
+    for (int i = 0; i < rect.h; i++) {
+        memcpy(frame + (long long)(rect.y + i)*width + rect.x, fragment, rect.w);
+        fragment += rect.w;
+    }
 }
 
 void AsyncAnimatedGif::AnimatedGifEncodeWorker::Execute() {
-    AnimatedGifEncoder encoder(gif_obj->width, gif_obj->height, BUF_RGB);
-    encoder.set_output_file(gif_obj->output_file.c_str());
-    encoder.set_transparency_color(gif_obj->transparency_color);
-
-    for (size_t push_id = 0; push_id < gif_obj->push_id; push_id++) {
-        char fragment_path[512];
-        snprintf(fragment_path, 512, "%s/%lu", gif_obj->tmp_dir.c_str(), push_id);
-        if (!is_dir(fragment_path)) {
-            char error[600];
-            snprintf(error, 600, "Error in AsyncAnimatedGif::AnimatedGifEncodeWorker::Execute() %s is not a dir.",
-                fragment_path);
-            errmsg = strdup(error);
-            return;
-        }
-
-        char **fragments = find_files(fragment_path);
-        int nfragments = file_list_length(fragments);
-
-        qsort(fragments, nfragments, sizeof(char *), fragment_sort);
-
-        unsigned char *frame = init_frame(gif_obj->width, gif_obj->height, gif_obj->transparency_color);
-        if (!frame) {
-            free_file_list(fragments);
-            errmsg = strdup("malloc failed in AsyncAnimatedGif::AnimatedGifEncodeWorker::Execute().");
-            return;
-        }
-
-        for (int i = 0; i < nfragments; i++) {
-            snprintf(fragment_path, 512, "%s/%lu/%s",
-                gif_obj->tmp_dir.c_str(), push_id, fragments[i]);
-            FILE *in = fopen(fragment_path, "r");
-            if (!in) {
-                free_file_list(fragments);
-                free(frame);
-                char error[600];
-                snprintf(error, 600, "Failed opening %s in AsyncAnimatedGif::AnimatedGifEncodeWorker::Execute().",
-                    fragment_path);
-                errmsg = strdup(error);
-                return;
-            }
-            int size = file_size(fragment_path);
-            unsigned char *data = (unsigned char *)malloc(sizeof(*data)*size);
-            if (!data) {
-                free_file_list(fragments);
-                free(frame);
-                fclose(in);
-                errmsg = strdup("malloc failed in AsyncAnimatedGif::AnimatedGifEncodeWorker::Execute().");
-                return;
-            }
-            int read = fread(data, sizeof *data, size, in);
-            if (read != size) {
-                free_file_list(fragments);
-                free(frame);
-                fclose(in);
-                free(data);
-                char error[600];
-                snprintf(error, 600, "Error - should have read %d but read only %d from %s in AsyncAnimatedGif::AnimatedGifEncodeWorker::Execute()", size, read, fragment_path);
-                errmsg = strdup(error);
-                return;
-            }
-            Rect dims = rect_dims(fragments[i]);
-            push_fragment(frame, gif_obj->width, gif_obj->height, gif_obj->buf_type,
-                data, dims.x, dims.y, dims.w, dims.h);
-            fclose(in);
-            free(data);
-        }
-        encoder.new_frame(frame);
-        free_file_list(fragments);
-        free(frame);
+    gif_obj->spool.close_file();
+    if (gif_obj->error_msg) {
+        errmsg = strdup(gif_obj->error_msg);
+        return;
     }
-    encoder.finish();
 
-    return;
+    try {
+        gif_obj->encoder->finish();
+    }
+    catch (const char *err) {
+        errmsg = strdup(err);
+    }
 }
 
 void AsyncAnimatedGif::AnimatedGifEncodeWorker::HandleOKCallback() {
@@ -401,10 +515,13 @@ NAN_METHOD(AsyncAnimatedGif::Encode)
 
     Local<Function> callback = Local<Function>::Cast(args[0]);
     AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    if (gif->encode_callback || gif->finishing)
+        return NanThrowError("Already encoding.");
 
-    NanAsyncQueueWorker(new AsyncAnimatedGif::AnimatedGifEncodeWorker(new NanCallback(callback), gif));
-
+    // finishes once the frames closed so far are encoded
+    gif->encode_callback = new NanCallback(callback);
     gif->Ref();
+    gif->finish_encode();
 
     NanReturnUndefined();
 }
@@ -441,6 +558,84 @@ NAN_METHOD(AsyncAnimatedGif::SetTmpDir)
 
     AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
     gif->tmp_dir = *tmp_dir;
+    gif->spool.set_dir(gif->tmp_dir);
 
     NanReturnUndefined();
 }
+
+NAN_METHOD(AsyncAnimatedGif::SetMemoryBudget)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - memory budget in bytes.");
+
+    if (!args[0]->IsNumber())
+        return NanThrowTypeError("First argument must be number.");
+
+    double budget = args[0]->NumberValue();
+    if (budget < 0)
+        return NanThrowRangeError("Memory budget smaller than 0.");
+
+    AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    gif->spool.set_memory_budget((long long)budget);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(AsyncAnimatedGif::SetCompression)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - zlib compression level.");
+
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer compression level.");
+
+    int level = args[0]->Int32Value();
+    if (level < 0 || level > 9)
+        return NanThrowRangeError("Compression level must be between 0 and 9.");
+
+    AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    gif->spool.set_compression(level);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(AsyncAnimatedGif::SetParallelFrames)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - number of frames.");
+
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer number of frames.");
+
+    int n = args[0]->Int32Value();
+    if (n < 1 || n > MAX_PARALLEL_FRAMES)
+        return NanThrowRangeError("Number of frames must be between 1 and " STRINGIFY(MAX_PARALLEL_FRAMES) ".");
+
+    AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    gif->parallel_frames = n;
+    gif->encode_next_frame();
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(AsyncAnimatedGif::GetSpoolStats)
+{
+    NanScope();
+
+    AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+
+    Local<Object> ret = Object::New();
+    ret->Set(String::NewSymbol("fragments"), Number::New(gif->spool.fragments_pushed()));
+    ret->Set(String::NewSymbol("memoryBytes"), Number::New(gif->spool.memory_in_use()));
+    ret->Set(String::NewSymbol("spilledBytes"), Number::New(gif->spool.bytes_spilled()));
+    ret->Set(String::NewSymbol("pushedBytes"), Number::New(gif->spool.bytes_pushed()));
+    ret->Set(String::NewSymbol("storedBytes"), Number::New(gif->spool.bytes_stored()));
+
+    NanReturnValue(ret);
+}
@@ -1,42 +1,17 @@
 #ifndef ASYNC_ANIMATED_GIF_H
 #define ASYNC_ANIMATED_GIF_H
 
+#include <deque>
 #include <string>
+#include <vector>
 
 #include <node.h>
 #include <node_buffer.h>
 
 #include "gif_encoder.h"
+#include "fragment_spool.h"
 #include "common.h"
 
-class PushWorker : public NanAsyncWorker {
-public:
-    PushWorker(unsigned int push_id, unsigned int fragment_id, const char *tmp_dir, unsigned char *data_buf, int x, int y, int w, int h) : NanAsyncWorker(NULL), push_id(push_id), fragment_id(fragment_id), tmp_dir(tmp_dir), data_size(w * h * 3), x(x), y(y), w(w), h(h) {
-        data = new unsigned char[sizeof(*data) * w * h * 3];
-        if (!data) {
-            throw "malloc in AsyncAnimatedGif::Push failed.";
-        }
-
-        memcpy(data, data_buf, w * h * 3);
-    };
-
-    ~PushWorker() {
-        delete[] data;
-    }
-
-    void Execute();
-    void HandleOKCallback();
-    void HandleErrorCallback();
-
-protected:
-    unsigned int push_id;
-    unsigned int fragment_id;
-    const char *tmp_dir;
-    unsigned char *data;
-    int data_size;
-    int x, y, w, h;
-};
-
 class AsyncAnimatedGif;
 
 class AsyncAnimatedGif : public node::ObjectWrap {
@@ -48,18 +23,103 @@ class AsyncAnimatedGif : public node::ObjectWrap {
     unsigned int push_id, fragment_id;
     std::string tmp_dir, output_file;
 
-    static unsigned char *init_frame(int width, int height, Color &transparency_color);
-    static void push_fragment(unsigned char *frame, int width, int height, buffer_type buf_type,
-        unsigned char *fragment, int x, int y, int w, int h);
-    static Rect rect_dims(const char *fragment_name);
+    // A frame on its way to the output, with scratch memory that is kept
+    // for the next one.
+    struct FrameSlot {
+        std::vector<SpoolFragment> fragments;
+        GifByteType *frame; // put together from the fragments
+        SpoolReadBuffer read_buf;
+        IndexedFrame indexed;
+        bool first, done;
+
+        FrameSlot() : frame(NULL), first(false), done(false) {}
+        ~FrameSlot() { free(frame); }
+    };
+
+    // Fragments go to the spool, where SpoolStoreWorkers quantize and put
+    // away batches of them. Every frame endPush closes is put together,
+    // cropped and compressed by a FrameEncodeWorker as soon as its batches
+    // are stored, up to parallel_frames at once, and a FrameWriteWorker
+    // writes the prepared ones out in push order. encode is left with
+    // writing the trailer.
+    FragmentSpool spool;
+    int pending_writes;
+    std::deque<std::vector<SpoolFragment> > frames; // closed, not started yet
+    int parallel_frames;
+    unsigned int frames_started;
+    std::deque<FrameSlot *> slots; // started frames not written yet, in order
+    std::vector<FrameSlot *> idle_slots;
+    int slots_busy, preparing;
+    bool writing, finishing;
+    AnimatedGifEncoder *encoder;
+    char *error_msg; // of the first store or frame that failed
+    NanCallback *encode_callback;
+
+    void write_batch();
+    void write_done(SpoolBatch *batch, const char *error);
+    void set_error(const char *error);
+    void make_encoder();
+    FrameSlot *get_slot();
+    void encode_next_frame();
+    void encode_frame(FrameSlot *slot);
+    void frame_done(FrameSlot *slot, const char *error);
+    void write_frames();
+    void frames_written(const std::vector<FrameSlot *> &written, const char *error);
+    void finish_encode();
+
+    static void push_fragment(GifByteType *frame, int width, const GifByteType *fragment,
+        const Rect &rect);
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
 
     AsyncAnimatedGif(int wwidth, int hheight, buffer_type bbuf_type);
+    ~AsyncAnimatedGif();
     v8::Handle<v8::Value> Push(unsigned char *data_buf, int x, int y, int w, int h);
     void EndPush();
 
+    class SpoolStoreWorker : public NanAsyncWorker {
+    public:
+        SpoolStoreWorker(AsyncAnimatedGif *gif, SpoolBatch *bbatch) :
+            NanAsyncWorker(NULL), gif_obj(gif), batch(bbatch) {}
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        AsyncAnimatedGif *gif_obj;
+        SpoolBatch *batch; // the spool's
+    };
+
+    class FrameEncodeWorker : public NanAsyncWorker {
+    public:
+        FrameEncodeWorker(AsyncAnimatedGif *gif, FrameSlot *sslot) :
+            NanAsyncWorker(NULL), gif_obj(gif), slot(sslot) {}
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        AsyncAnimatedGif *gif_obj;
+        FrameSlot *slot;
+    };
+
+    class FrameWriteWorker : public NanAsyncWorker {
+    public:
+        FrameWriteWorker(AsyncAnimatedGif *gif, const std::vector<FrameSlot *> &wwritten) :
+            NanAsyncWorker(NULL), gif_obj(gif), written(wwritten) {}
+
+        void Execute();
+        void HandleOKCallback();
+        void HandleErrorCallback();
+
+    private:
+        AsyncAnimatedGif *gif_obj;
+        std::vector<FrameSlot *> written;
+    };
+
     class AnimatedGifEncodeWorker : public AnimatedGifEncoder::EncodeWorker {
     public:
         AnimatedGifEncodeWorker(NanCallback *callback, AsyncAnimatedGif *gif) : AnimatedGifEncoder::EncodeWorker(callback), gif_obj(gif) {
@@ -79,6 +139,12 @@ public:
     static NAN_METHOD(EndPush);
     static NAN_METHOD(SetOutputFile);
     static NAN_METHOD(SetTmpDir);
+    static NAN_METHOD(SetMemoryBudget);
+    static NAN_METHOD(SetCompression);
+    static NAN_METHOD(SetParallelFrames);
+    static NAN_METHOD(GetSpoolStats);
 };
 
+#define MAX_PARALLEL_FRAMES 64
+
 #endif
@@ -9,3 +9,12 @@ bool str_eq(const char *s1, const char *s2)
     return strcmp(s1, s2) == 0;
 }
 
+int bytes_per_pixel(buffer_type buf_type)
+{
+    return (buf_type == BUF_RGBA || buf_type == BUF_BGRA) ? 4 : 3;
+}
+
+void free_buffer_data(char *data, void *hint)
+{
+    free(data);
+}
@@ -28,7 +28,18 @@ struct Color {
 
 bool str_eq(const char *s1, const char *s2);
 
+// A macro's value as a string literal, for limits in error messages.
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
 typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA } buffer_type;
 
+typedef enum { PALETTE_WEB_SAFE, PALETTE_ADAPTIVE, PALETTE_GLOBAL } palette_type;
+
+int bytes_per_pixel(buffer_type buf_type);
+
+// Free callback for Buffers made around malloc'ed data.
+void free_buffer_data(char *data, void *hint);
+
 #endif
 
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "common.h"
 #include "gif_encoder.h"
 #include "dynamic_gif_stack.h"
@@ -24,18 +26,19 @@ DynamicGifStack::optimal_dimension()
     return std::make_pair(top, bottom);
 }
 
+// Copies updates, in order, into data, an RGB image covering rect.
 void
-DynamicGifStack::construct_gif_data(unsigned char *data, Point &top)
+DynamicGifStack::paint_updates(unsigned char *data, const Rect &rect, const GifUpdates &updates)
 {
     switch (buf_type) {
     case BUF_RGB:
     case BUF_RGBA:
-        for (GifUpdates::iterator it = gif_stack.begin(); it != gif_stack.end(); ++it) {
+        for (GifUpdates::const_iterator it = updates.begin(); it != updates.end(); ++it) {
             GifUpdate *gif = *it;
-            int start = (gif->y - top.y)*width*3 + (gif->x - top.x)*3;
+            int start = (gif->y - rect.y)*rect.w*3 + (gif->x - rect.x)*3;
             unsigned char *gifdatap = gif->data;
             for (int i = 0; i < gif->h; i++) {
-                unsigned char *datap = &data[start + i*width*3];
+                unsigned char *datap = &data[start + i*rect.w*3];
                 for (int j = 0; j < gif->w; j++) {
                     *datap++ = *gifdatap++;
                     *datap++ = *gifdatap++;
@@ -48,12 +51,12 @@ DynamicGifStack::construct_gif_data(unsigned char *data, Point &top)
 
     case BUF_BGR:
     case BUF_BGRA:
-        for (GifUpdates::iterator it = gif_stack.begin(); it != gif_stack.end(); ++it) {
+        for (GifUpdates::const_iterator it = updates.begin(); it != updates.end(); ++it) {
             GifUpdate *gif = *it;
-            int start = (gif->y - top.y)*width*3 + (gif->x - top.x)*3;
+            int start = (gif->y - rect.y)*rect.w*3 + (gif->x - rect.x)*3;
             unsigned char *gifdatap = gif->data;
             for (int i = 0; i < gif->h; i++) {
-                unsigned char *datap = &data[start + i*width*3];
+                unsigned char *datap = &data[start + i*rect.w*3];
                 for (int j = 0; j < gif->w; j++) {
                     *datap++ = *(gifdatap + 2);
                     *datap++ = *(gifdatap + 1);
@@ -69,6 +72,158 @@ DynamicGifStack::construct_gif_data(unsigned char *data, Point &top)
     }
 }
 
+void
+DynamicGifStack::construct_gif_data(unsigned char *data, Point &top)
+{
+    paint_updates(data, Rect(top.x, top.y, width, height), gif_stack);
+}
+
+static long long
+rect_area(const Rect &r)
+{
+    return (long long)r.w*r.h;
+}
+
+static Rect
+rect_union(const Rect &a, const Rect &b)
+{
+    int x0 = std::min(a.x, b.x), y0 = std::min(a.y, b.y);
+    int x1 = std::max(a.x + a.w, b.x + b.w), y1 = std::max(a.y + a.h, b.y + b.h);
+    return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+static int
+find_root(std::vector<int> &parent, int i)
+{
+    while (parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+// Groups the updates so that clusters never overlap, as a later update has
+// to cover an earlier one the way it does on the canvas, and merges
+// clusters less than SPARSE_MERGE_SLACK pixels apart. Each pass sweeps the
+// clusters left to right and joins the close ones; a merged rect may reach
+// another cluster, so passes go on until nothing merges.
+std::vector<DynamicGifStack::Cluster>
+DynamicGifStack::cluster_updates()
+{
+    std::vector<Cluster> clusters;
+    for (size_t i = 0; i < gif_stack.size(); i++) {
+        GifUpdate *gif = gif_stack[i];
+        if (gif->w == 0 || gif->h == 0)
+            continue;
+        Cluster cluster;
+        cluster.rect = Rect(gif->x, gif->y, gif->w, gif->h);
+        cluster.updates.push_back(i);
+        clusters.push_back(cluster);
+    }
+
+    for (;;) {
+        bool merged = false;
+        int n = clusters.size();
+        std::vector<int> parent(n);
+        std::vector<std::pair<int, int> > by_x(n); // left edge, cluster
+        for (int i = 0; i < n; i++) {
+            parent[i] = i;
+            by_x[i] = std::make_pair(clusters[i].rect.x, i);
+        }
+        std::sort(by_x.begin(), by_x.end());
+
+        for (int i = 0; i < n; i++) {
+            const Rect &a = clusters[by_x[i].second].rect;
+            for (int j = i + 1; j < n && by_x[j].first < a.x + a.w + SPARSE_MERGE_SLACK; j++) {
+                const Rect &b = clusters[by_x[j].second].rect;
+                if (b.y >= a.y + a.h + SPARSE_MERGE_SLACK || a.y >= b.y + b.h + SPARSE_MERGE_SLACK)
+                    continue;
+                int ra = find_root(parent, by_x[i].second);
+                int rb = find_root(parent, by_x[j].second);
+                if (ra == rb)
+                    continue;
+                // the root is the cluster pushed first, so it keeps its place
+                parent[std::max(ra, rb)] = std::min(ra, rb);
+                merged = true;
+            }
+        }
+        if (!merged)
+            break;
+
+        for (int i = 0; i < n; i++) {
+            int r = find_root(parent, i);
+            if (r == i)
+                continue;
+            Cluster &root = clusters[r];
+            root.updates.insert(root.updates.end(), clusters[i].updates.begin(), clusters[i].updates.end());
+            root.rect = rect_union(root.rect, clusters[i].rect);
+        }
+        std::vector<Cluster> kept;
+        for (int i = 0; i < n; i++) {
+            if (parent[i] != i)
+                continue;
+            // keep the updates in push order
+            std::sort(clusters[i].updates.begin(), clusters[i].updates.end());
+            kept.push_back(Cluster());
+            kept.back().rect = clusters[i].rect;
+            kept.back().updates.swap(clusters[i].updates);
+        }
+        clusters.swap(kept);
+    }
+    return clusters;
+}
+
+// Encodes every cluster of updates as an image of its own over a logical
+// screen the size of the updates' bounding box, so only the clusters are
+// quantized and compressed. offset, width and height must be set. Returns
+// the gif, to be freed with free().
+unsigned char *
+DynamicGifStack::encode_sparse(int &gif_len)
+{
+    std::vector<Cluster> clusters = cluster_updates();
+    long long pixels = 0;
+    for (size_t i = 0; i < clusters.size(); i++)
+        pixels += rect_area(clusters[i].rect);
+    // only empty updates, a single transparent pixel stands for the screen
+    // the way the canvas path leaves it all transparent
+    bool blank = clusters.empty();
+    if (blank)
+        pixels = 1;
+
+    unsigned char *data = (unsigned char *)malloc(sizeof(*data)*(pixels > 0 ? pixels*3 : 1));
+    if (!data) throw "malloc failed in DynamicGifStack::encode_sparse";
+
+    unsigned char *datap = data;
+    for (long long i = 0; i < pixels; i++) {
+        *datap++ = transparency_color.r;
+        *datap++ = transparency_color.g;
+        *datap++ = transparency_color.b;
+    }
+
+    try {
+        SparseGifEncoder encoder(data, width, height, BUF_RGB);
+        encoder.set_transparency_color(transparency_color);
+        datap = data;
+        for (size_t i = 0; i < clusters.size(); i++) {
+            const Rect &r = clusters[i].rect;
+            GifUpdates updates;
+            for (size_t j = 0; j < clusters[i].updates.size(); j++)
+                updates.push_back(gif_stack[clusters[i].updates[j]]);
+            paint_updates(datap, r, updates);
+            datap += rect_area(r)*3;
+            encoder.add_image(Rect(r.x - offset.x, r.y - offset.y, r.w, r.h));
+        }
+        if (blank)
+            encoder.add_image(Rect(0, 0, 1, 1));
+        encoder.encode();
+        free(data);
+        gif_len = encoder.get_gif_len();
+        return encoder.release_gif();
+    }
+    catch (const char *) {
+        free(data);
+        throw;
+    }
+}
+
 void
 DynamicGifStack::Initialize(Handle<Object> target)
 {
@@ -80,11 +235,12 @@ DynamicGifStack::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "encode", GifEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", GifEncodeSync);
     NODE_SET_PROTOTYPE_METHOD(t, "dimensions", Dimensions);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSparse", SetSparse);
     target->Set(String::NewSymbol("DynamicGifStack"), t->GetFunction());
 }
 
 DynamicGifStack::DynamicGifStack(buffer_type bbuf_type) :
-    buf_type(bbuf_type), transparency_color(0xFF, 0xFF, 0xFE) {}
+    buf_type(bbuf_type), transparency_color(0xFF, 0xFF, 0xFE), sparse(false) {}
 
 DynamicGifStack::~DynamicGifStack()
 {
@@ -118,6 +274,21 @@ DynamicGifStack::GifEncodeSync()
     offset = top;
     width = bot.x - top.x;
     height = bot.y - top.y;
+    if (width <= 0 || height <= 0)
+        return scope.Close(ThrowException(Exception::Error(String::New("Nothing to encode, the pushed updates have no pixels."))));
+
+    if (sparse) {
+        try {
+            int gif_len;
+            unsigned char *gif = encode_sparse(gif_len);
+            Local<Object> retbuf = NanNewBufferHandle((char *)gif, gif_len,
+                free_buffer_data, NULL);
+            return scope.Close(retbuf);
+        }
+        catch (const char *err) {
+            return scope.Close(ThrowException(Exception::Error(String::New(err))));
+        }
+    }
 
     unsigned char *data = (unsigned char*)malloc(sizeof(*data)*width*height*3);
     if (!data) return scope.Close(ThrowException(Exception::Error(String::New("malloc failed in DynamicGifStack::GifEncode"))));
@@ -137,8 +308,8 @@ DynamicGifStack::GifEncodeSync()
         encoder.encode();
         free(data);
         int gif_len = encoder.get_gif_len();
-        Local<Object> retbuf = NanNewBufferHandle(gif_len);
-        memcpy(Buffer::Data(retbuf), encoder.get_gif(), gif_len);
+        Local<Object> retbuf = NanNewBufferHandle((char *)encoder.release_gif(), gif_len,
+            free_buffer_data, NULL);
         return scope.Close(retbuf);
     }
     catch (const char *err) {
@@ -239,6 +410,22 @@ NAN_METHOD(DynamicGifStack::Dimensions)
     NanReturnValue(gif_stack->Dimensions());
 }
 
+NAN_METHOD(DynamicGifStack::SetSparse)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return NanThrowTypeError("First argument must be boolean.");
+
+    DynamicGifStack *gif_stack = ObjectWrap::Unwrap<DynamicGifStack>(args.This());
+    gif_stack->sparse = args[0]->BooleanValue();
+
+    NanReturnUndefined();
+}
+
 NAN_METHOD(DynamicGifStack::GifEncodeSync)
 {
     NanScope();
@@ -254,6 +441,20 @@ void DynamicGifStack::DynamicGifEncodeWorker::Execute() {
     gif_obj->offset = top;
     gif_obj->width = bot.x - top.x;
     gif_obj->height = bot.y - top.y;
+    if (gif_obj->width <= 0 || gif_obj->height <= 0) {
+        errmsg = strdup("Nothing to encode, the pushed updates have no pixels.");
+        return;
+    }
+
+    if (gif_obj->sparse) {
+        try {
+            gif = (char *)gif_obj->encode_sparse(gif_len);
+        }
+        catch (const char *err) {
+            errmsg = strdup(err);
+        }
+        return;
+    }
 
     unsigned char *data = (unsigned char*)malloc(sizeof(*data)*gif_obj->width*gif_obj->height*3);
     if (!data) {
@@ -276,14 +477,7 @@ void DynamicGifStack::DynamicGifEncodeWorker::Execute() {
         encoder.encode();
         free(data);
         gif_len = encoder.get_gif_len();
-        gif = (char *)malloc(sizeof(*gif)*gif_len);
-        if (!gif) {
-            errmsg = strdup("malloc in DynamicGifStack::DynamicGifEncodeWorker::Execute() failed.");
-            return;
-        }
-        else {
-            memcpy(gif, encoder.get_gif(), gif_len);
-        }
+        gif = (char *)encoder.release_gif();
     }
     catch (const char *err) {
         free(data);
@@ -293,8 +487,8 @@ void DynamicGifStack::DynamicGifEncodeWorker::Execute() {
 
 void DynamicGifStack::DynamicGifEncodeWorker::HandleOKCallback() {
     NanScope();
-    Local<Object> buf = NanNewBufferHandle(gif_len);
-    memcpy(Buffer::Data(buf), gif, gif_len);
+    Local<Object> buf = NanNewBufferHandle(gif, gif_len, free_buffer_data, NULL);
+    gif = NULL; // owned by buf now
     Local<Value> argv[3] = {buf, gif_obj->Dimensions(), Undefined()};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -304,9 +498,6 @@ void DynamicGifStack::DynamicGifEncodeWorker::HandleOKCallback() {
     if (try_catch.HasCaught())
         FatalException(try_catch);
 
-    free(gif);
-    gif = NULL;
-
     gif_obj->Unref();
 }
 
@@ -37,9 +37,20 @@ class DynamicGifStack : public node::ObjectWrap {
     buffer_type buf_type;
     Color transparency_color;
 
+    // Updates that overlap or lie close enough to each other, encoded as
+    // one image in sparse mode.
+    struct Cluster {
+        Rect rect;
+        std::vector<int> updates; // indices into gif_stack, in push order
+    };
+    bool sparse;
+
     std::pair<Point, Point> optimal_dimension();
 
+    void paint_updates(unsigned char *data, const Rect &rect, const GifUpdates &updates);
     void construct_gif_data(unsigned char *data, Point &top);
+    std::vector<Cluster> cluster_updates();
+    unsigned char *encode_sparse(int &gif_len);
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
@@ -69,7 +80,12 @@ public:
     static NAN_METHOD(Dimensions);
     static NAN_METHOD(GifEncodeSync);
     static NAN_METHOD(GifEncodeAsync);
+    static NAN_METHOD(SetSparse);
 };
 
+// Clusters closer than this many pixels are merged, the filler between
+// them costs less than another image descriptor.
+#define SPARSE_MERGE_SLACK 16
+
 #endif
 
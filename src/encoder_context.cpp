@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <cstdlib>
+#include <uv.h>
+
+#include "common.h"
+#include "encoder_context.h"
+#include "adaptive_quantize.h"
+#include "lzw.h"
+
+EncoderContext::EncoderContext() :
+    index_buf(NULL), index_buf_size(0), crop_buf(NULL), crop_buf_size(0), quantizer(NULL) {}
+
+EncoderContext::~EncoderContext()
+{
+    free(index_buf);
+    free(crop_buf);
+    for (size_t i = 0; i < lzw.size(); i++)
+        delete lzw[i];
+    delete quantizer;
+}
+
+void
+EncoderContext::reserve(int pixels)
+{
+    index_buffer(pixels);
+    lzw_encoder(0)->reserve_pixels(pixels);
+}
+
+GifByteType *
+EncoderContext::index_buffer(int pixels)
+{
+    if (pixels > index_buf_size) {
+        GifByteType *new_buf = (GifByteType *)realloc(index_buf, pixels);
+        if (!new_buf)
+            throw "realloc in EncoderContext::index_buffer failed";
+        index_buf = new_buf;
+        index_buf_size = pixels;
+    }
+    return index_buf;
+}
+
+unsigned char *
+EncoderContext::crop_buffer(int bytes)
+{
+    if (bytes > crop_buf_size) {
+        unsigned char *new_buf = (unsigned char *)realloc(crop_buf, bytes);
+        if (!new_buf)
+            throw "realloc in EncoderContext::crop_buffer failed";
+        crop_buf = new_buf;
+        crop_buf_size = bytes;
+    }
+    return crop_buf;
+}
+
+LzwEncoder *
+EncoderContext::lzw_encoder(int i)
+{
+    while ((int)lzw.size() <= i)
+        lzw.push_back(new LzwEncoder());
+    return lzw[i];
+}
+
+AdaptiveQuantizer *
+EncoderContext::adaptive_quantizer()
+{
+    if (!quantizer)
+        quantizer = new AdaptiveQuantizer();
+    return quantizer;
+}
+
+size_t
+EncoderContext::memory() const
+{
+    size_t bytes = index_buf_size + crop_buf_size;
+    for (size_t i = 0; i < lzw.size(); i++)
+        bytes += lzw[i]->memory();
+    if (quantizer)
+        bytes += AdaptiveQuantizer::memory();
+    return bytes;
+}
+
+struct ContextPool {
+    uv_mutex_t mutex;
+    std::vector<EncoderContext *> idle;
+    size_t idle_bytes;
+    int hits, misses;
+
+    ContextPool() : idle_bytes(0), hits(0), misses(0) { uv_mutex_init(&mutex); }
+};
+
+static ContextPool pool;
+
+static const size_t max_idle_bytes = (size_t)MAX_IDLE_MB << 20;
+
+// With the pool's mutex held. Contexts don't change while idle, so the
+// bytes added here are the ones taken off again in take_idle.
+static bool
+keep_idle(EncoderContext *context)
+{
+    size_t bytes = context->memory();
+    if (pool.idle.size() >= MAX_IDLE_CONTEXTS || pool.idle_bytes + bytes > max_idle_bytes)
+        return false;
+    pool.idle.push_back(context);
+    pool.idle_bytes += bytes;
+    return true;
+}
+
+// With the pool's mutex held.
+static EncoderContext *
+take_idle()
+{
+    EncoderContext *context = pool.idle.back(); // most recently used, likely still cached
+    pool.idle.pop_back();
+    pool.idle_bytes -= context->memory();
+    return context;
+}
+
+EncoderContext *
+acquire_encoder_context()
+{
+    EncoderContext *context = NULL;
+    uv_mutex_lock(&pool.mutex);
+    if (!pool.idle.empty()) {
+        context = take_idle();
+        pool.hits++;
+    }
+    else {
+        pool.misses++;
+    }
+    uv_mutex_unlock(&pool.mutex);
+
+    return context ? context : new EncoderContext();
+}
+
+void
+release_encoder_context(EncoderContext *context)
+{
+    if (!context) return;
+
+    uv_mutex_lock(&pool.mutex);
+    bool keep = keep_idle(context);
+    uv_mutex_unlock(&pool.mutex);
+
+    if (!keep)
+        delete context;
+}
+
+void
+reserve_encoder_contexts(int count, int width, int height)
+{
+    // take the idle ones out, to grow them or free the ones over count
+    std::vector<EncoderContext *> contexts;
+    uv_mutex_lock(&pool.mutex);
+    while (!pool.idle.empty())
+        contexts.push_back(take_idle());
+    uv_mutex_unlock(&pool.mutex);
+    contexts.resize(std::max((int)contexts.size(), count), NULL);
+
+    // one at a time, so going over the memory limit stops before
+    // allocating the rest
+    const char *err = NULL;
+    for (size_t i = 0; i < contexts.size(); i++) {
+        EncoderContext *context = contexts[i];
+        if ((int)i >= count || err) {
+            delete context;
+            continue;
+        }
+        try {
+            if (!context)
+                context = new EncoderContext();
+            context->reserve(width*height);
+        }
+        catch (const char *e) {
+            delete context;
+            err = e;
+            continue;
+        }
+
+        uv_mutex_lock(&pool.mutex);
+        bool kept = keep_idle(context);
+        uv_mutex_unlock(&pool.mutex);
+        if (!kept) {
+            delete context;
+            err = "Encoder contexts of that size take more than the " STRINGIFY(MAX_IDLE_MB) "MB the pool keeps.";
+        }
+    }
+
+    if (err)
+        throw err;
+}
+
+EncoderContextStats
+get_encoder_context_stats()
+{
+    EncoderContextStats stats;
+    uv_mutex_lock(&pool.mutex);
+    stats.hits = pool.hits;
+    stats.misses = pool.misses;
+    stats.idle = pool.idle.size();
+    stats.idle_bytes = pool.idle_bytes;
+    uv_mutex_unlock(&pool.mutex);
+    return stats;
+}
+
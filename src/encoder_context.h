@@ -0,0 +1,60 @@
+#ifndef ENCODER_CONTEXT_H
+#define ENCODER_CONTEXT_H
+
+#include <vector>
+#include <gif_lib.h>
+
+class AdaptiveQuantizer;
+class LzwEncoder;
+
+// Scratch memory for one encode at a time: the index buffer, LZW encoders
+// (one per strip), the adaptive quantizer and room for cropped frames.
+// Everything is allocated on first use and kept, growing to the biggest
+// frame seen, so a context borrowed from the pool usually needs no
+// allocations at all.
+class EncoderContext {
+    GifByteType *index_buf;
+    int index_buf_size;
+    unsigned char *crop_buf;
+    int crop_buf_size;
+    std::vector<LzwEncoder *> lzw;
+    AdaptiveQuantizer *quantizer;
+
+public:
+    EncoderContext();
+    ~EncoderContext();
+
+    // Allocates what a web safe encode of this many pixels needs.
+    void reserve(int pixels);
+
+    GifByteType *index_buffer(int pixels);
+    unsigned char *crop_buffer(int bytes); // pixels cut out of a bigger frame
+    LzwEncoder *lzw_encoder(int i);
+    AdaptiveQuantizer *adaptive_quantizer();
+
+    // Bytes allocated so far.
+    size_t memory() const;
+};
+
+struct EncoderContextStats {
+    int hits, misses; // acquires served by an idle context / a new one
+    int idle;
+    double idle_bytes;
+};
+
+// Pool of idle contexts shared by all encoders and threads. It keeps no
+// more than MAX_IDLE_CONTEXTS of them and MAX_IDLE_MB of memory, contexts
+// released past either are freed.
+EncoderContext *acquire_encoder_context();
+void release_encoder_context(EncoderContext *context);
+
+// Leaves count idle contexts in the pool, sized for width x height frames,
+// freeing any over count.
+void reserve_encoder_contexts(int count, int width, int height);
+EncoderContextStats get_encoder_context_stats();
+
+#define MAX_IDLE_CONTEXTS 64
+#define MAX_IDLE_MB 256
+
+#endif
+
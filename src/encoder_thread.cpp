@@ -0,0 +1,179 @@
+#include <cstdlib>
+
+#include "encoder_thread.h"
+#include "gif_encoder.h"
+
+EncoderThread::EncoderThread(AnimatedGifEncoder &eencoder, int mmax_frames,
+    frame_written_func fframe_written, void *fframe_written_arg) :
+    encoder(eencoder), max_frames(mmax_frames),
+    frame_written(fframe_written), frame_written_arg(fframe_written_arg),
+    started(false), finishing(false), joining(false), joined(false), error(NULL)
+{
+    uv_mutex_init(&mutex);
+    uv_cond_init(&cond);
+}
+
+EncoderThread::~EncoderThread()
+{
+    try {
+        finish();
+    }
+    catch (const char *err) {
+        // nobody is left to tell
+    }
+    uv_cond_destroy(&cond);
+    uv_mutex_destroy(&mutex);
+}
+
+void
+EncoderThread::run(void *arg)
+{
+    ((EncoderThread *)arg)->encode_frames();
+}
+
+void
+EncoderThread::encode_frames()
+{
+    uv_mutex_lock(&mutex);
+    for (;;) {
+        while (queue.empty() && !finishing)
+            uv_cond_wait(&cond, &mutex);
+        if (queue.empty())
+            break;
+
+        Frame frame = queue.front();
+        bool failed = error != NULL;
+        uv_mutex_unlock(&mutex);
+
+        const char *err = NULL;
+        if (!failed) {
+            try {
+                encoder.new_frame(frame.data, frame.delay, frame.has_dirty ? &frame.dirty : NULL);
+            }
+            catch (const char *e) {
+                err = e;
+            }
+        }
+        free(frame.data);
+        if (frame_written)
+            frame_written(frame_written_arg);
+
+        uv_mutex_lock(&mutex);
+        queue.pop_front(); // only now, so a full queue counts the frame being encoded
+        if (err && !error)
+            error = err;
+        stats = encoder.get_stats();
+        uv_cond_broadcast(&cond);
+    }
+    uv_mutex_unlock(&mutex);
+
+    const char *err = NULL;
+    try {
+        encoder.finish();
+    }
+    catch (const char *e) {
+        err = e;
+    }
+    uv_mutex_lock(&mutex);
+    if (err && !error)
+        error = err;
+    stats = encoder.get_stats(); // a held back frame may only be written now
+    uv_mutex_unlock(&mutex);
+}
+
+void
+EncoderThread::push(unsigned char *data, int delay, const Rect *dirty)
+{
+    Frame frame;
+    frame.data = data;
+    frame.delay = delay;
+    frame.has_dirty = dirty != NULL;
+    if (dirty)
+        frame.dirty = *dirty;
+
+    uv_mutex_lock(&mutex);
+    if (finishing) {
+        uv_mutex_unlock(&mutex);
+        free(data);
+        throw "Frame pushed after the encoding was finished";
+    }
+    if (!started) {
+        if (uv_thread_create(&thread, run, this) != 0) {
+            uv_mutex_unlock(&mutex);
+            free(data);
+            throw "uv_thread_create in EncoderThread::push failed";
+        }
+        started = true;
+    }
+    while ((int)queue.size() >= max_frames && !error)
+        uv_cond_wait(&cond, &mutex);
+    const char *err = error;
+    if (!err)
+        queue.push_back(frame);
+    uv_mutex_unlock(&mutex);
+
+    if (err) {
+        free(data);
+        throw err;
+    }
+    uv_cond_broadcast(&cond);
+}
+
+bool
+EncoderThread::full()
+{
+    uv_mutex_lock(&mutex);
+    bool ret = (int)queue.size() >= max_frames && !error;
+    uv_mutex_unlock(&mutex);
+    return ret;
+}
+
+EncoderStats
+EncoderThread::get_stats()
+{
+    uv_mutex_lock(&mutex);
+    EncoderStats ret = stats;
+    uv_mutex_unlock(&mutex);
+    return ret;
+}
+
+void
+EncoderThread::finish()
+{
+    uv_mutex_lock(&mutex);
+    bool join = !joining;
+    finishing = true;
+    joining = true;
+    uv_cond_broadcast(&cond);
+    uv_mutex_unlock(&mutex);
+
+    if (join) {
+        const char *err = NULL;
+        if (started) {
+            uv_thread_join(&thread);
+        }
+        else {
+            try {
+                encoder.finish();
+            }
+            catch (const char *e) {
+                err = e;
+            }
+        }
+        uv_mutex_lock(&mutex);
+        if (err && !error)
+            error = err;
+        joined = true;
+        uv_cond_broadcast(&cond);
+        uv_mutex_unlock(&mutex);
+    }
+
+    uv_mutex_lock(&mutex);
+    while (!joined)
+        uv_cond_wait(&cond, &mutex);
+    const char *err = error;
+    uv_mutex_unlock(&mutex);
+
+    if (err)
+        throw err;
+}
@@ -0,0 +1,62 @@
+#ifndef ENCODER_THREAD_H
+#define ENCODER_THREAD_H
+
+#include <deque>
+#include <uv.h>
+
+#include "common.h"
+#include "gif_encoder.h"
+
+typedef void (*frame_written_func)(void *arg);
+
+// Runs an AnimatedGifEncoder on a thread of its own. Frames are queued and
+// encoded in the order they were pushed; push waits while max_frames are
+// already waiting. The encoder must not be touched from elsewhere until
+// finish returns, get_stats has a copy of its stats.
+class EncoderThread {
+    struct Frame {
+        unsigned char *data;
+        int delay;
+        Rect dirty;
+        bool has_dirty;
+    };
+
+    AnimatedGifEncoder &encoder;
+    int max_frames;
+    frame_written_func frame_written; // called on the thread after every frame
+    void *frame_written_arg;
+
+    uv_thread_t thread;
+    uv_mutex_t mutex;
+    uv_cond_t cond;
+    std::deque<Frame> queue;
+    bool started, finishing;
+    bool joining, joined; // the first finish call is joining the thread / has
+    const char *error; // first error the encoder threw
+    EncoderStats stats; // the encoder's, as of the last frame written
+
+    static void run(void *arg);
+    void encode_frames();
+
+public:
+    EncoderThread(AnimatedGifEncoder &eencoder, int mmax_frames,
+        frame_written_func fframe_written=NULL, void *fframe_written_arg=NULL);
+    ~EncoderThread();
+
+    // Takes ownership of data, which must be malloc'ed, waiting while the
+    // queue is full. Throws the error an earlier frame failed with, if any.
+    void push(unsigned char *data, int delay, const Rect *dirty);
+
+    // True while max_frames are waiting, so push would wait. Only the
+    // encoder thread takes frames off, so it stays false until the next push.
+    bool full();
+
+    EncoderStats get_stats();
+
+    // Waits for the queued frames, then finishes the encoder. Throws the
+    // first error any frame failed with. Calls made while another one is
+    // still finishing wait for it.
+    void finish();
+};
+
+#endif
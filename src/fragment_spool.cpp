@@ -0,0 +1,325 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "fragment_spool.h"
+#include "quantize.h"
+
+FragmentSpool::FragmentSpool(buffer_type bbuf_type) :
+    buf_type(bbuf_type), compression(0), memory_budget(DEFAULT_SPOOL_MEMORY_BUDGET),
+    batch(NULL), fragment_count(0), fd(-1), memory_used(0),
+    raw_bytes(0), stored_bytes(0), file_end(0)
+{
+    uv_mutex_init(&mutex);
+}
+
+FragmentSpool::~FragmentSpool()
+{
+    close_file();
+    for (size_t i = 0; i < batches.size(); i++)
+        delete batches[i];
+    uv_mutex_destroy(&mutex);
+}
+
+void
+FragmentSpool::set_dir(const std::string &ddir)
+{
+    // a worker may be opening the file
+    uv_mutex_lock(&mutex);
+    dir = ddir;
+    uv_mutex_unlock(&mutex);
+}
+
+// With the mutex held. The file is read back through the same descriptor
+// and unlinked right away, nothing is left behind however the spool ends.
+void
+FragmentSpool::open_file()
+{
+    if (dir.empty())
+        throw "Tmp dir is not set. Use .setTmpDir to set it, fragments are over the memory budget.";
+
+    static unsigned int spools = 0;
+    char name[512];
+    snprintf(name, 512, "%s/fragments-%d-%u.spool", dir.c_str(), (int)getpid(), spools++);
+
+    fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        throw "Failed to open the fragment spool in FragmentSpool::store.";
+    unlink(name);
+}
+
+void
+FragmentSpool::append(unsigned int push_id, const Rect &rect, const unsigned char *data, int size)
+{
+    if (rect.w == 0 || rect.h == 0)
+        return; // nothing to draw
+    if (!batch) {
+        batch = new SpoolBatch();
+        batches.push_back(batch);
+    }
+    if (batch->raw_len + size > batch->raw_size) {
+        long long new_size = batch->raw_len + size;
+        if (new_size < SPOOL_BATCH_SIZE)
+            new_size = SPOOL_BATCH_SIZE;
+        if ((long long)(size_t)new_size != new_size)
+            throw "Fragments too big for a batch in FragmentSpool::append";
+        unsigned char *new_raw = (unsigned char *)realloc(batch->raw, new_size);
+        if (!new_raw)
+            throw "realloc in FragmentSpool::append failed";
+        batch->raw = new_raw;
+        batch->raw_size = new_size;
+    }
+
+    SpoolFragment fragment;
+    fragment.push_id = push_id;
+    fragment.rect = rect;
+    fragment.batch = batch;
+    fragment.item = batch->pixels.size();
+    fragments.push_back(fragment);
+    fragment_count++;
+
+    memcpy(batch->raw + batch->raw_len, data, size);
+    batch->raw_len += size;
+    batch->pixels.push_back(rect.w*rect.h);
+}
+
+bool
+FragmentSpool::batch_full() const
+{
+    return batch && batch->raw_len >= SPOOL_BATCH_SIZE;
+}
+
+SpoolBatch *
+FragmentSpool::seal_batch()
+{
+    SpoolBatch *ret = batch;
+    batch = NULL;
+    if (ret) {
+        ret->compression = compression;
+        ret->memory_budget = memory_budget;
+    }
+    return ret;
+}
+
+void
+FragmentSpool::store(SpoolBatch *b)
+{
+    long long total = 0;
+    for (size_t i = 0; i < b->pixels.size(); i++)
+        total += b->pixels[i];
+
+    // Indices take a byte per pixel. Deflated fragments go one after
+    // another into a buffer with room for the worst case of each.
+    long long room = total;
+    if (b->compression) {
+        room = 0;
+        for (size_t i = 0; i < b->pixels.size(); i++)
+            room += compressBound(b->pixels[i]);
+    }
+    if ((long long)(size_t)room != room || (long long)(size_t)total != total)
+        throw "Batch too big for memory in FragmentSpool::store";
+    GifByteType *indices = (GifByteType *)malloc(total > 0 ? total : 1);
+    GifByteType *out = b->compression ? (GifByteType *)malloc(room > 0 ? room : 1) : indices;
+    if (!indices || !out) {
+        free(indices);
+        if (out != indices) free(out);
+        throw "malloc in FragmentSpool::store failed";
+    }
+
+    int bpp = bytes_per_pixel(buf_type);
+    const unsigned char *raw = b->raw;
+    long long in = 0, len = 0;
+    for (size_t i = 0; i < b->pixels.size(); i++) {
+        int n = b->pixels[i];
+        web_safe_quantize(n, 1, raw, buf_type, indices + in);
+        raw += (size_t)n*bpp;
+
+        long long size = n;
+        if (b->compression) {
+            uLongf dest_len = room - len;
+            if (compress2(out + len, &dest_len, indices + in, n, b->compression) != Z_OK) {
+                free(indices);
+                free(out);
+                throw "compress2 in FragmentSpool::store failed";
+            }
+            size = dest_len;
+        }
+        b->offsets.push_back(b->compression ? len : in);
+        b->sizes.push_back(size);
+        in += n;
+        len += size;
+    }
+    if (b->compression)
+        free(indices);
+    b->stored_len = len;
+    b->deflated = b->compression != 0;
+    free(b->raw);
+    b->raw = NULL;
+    b->raw_len = b->raw_size = 0;
+
+    uv_mutex_lock(&mutex);
+    raw_bytes += total*bpp;
+    stored_bytes += len;
+    bool spill = memory_used + len > b->memory_budget;
+    long long offset = file_end;
+    if (spill) {
+        try {
+            if (fd == -1)
+                open_file();
+        }
+        catch (const char *err) {
+            uv_mutex_unlock(&mutex);
+            free(out);
+            throw;
+        }
+        file_end += len;
+    }
+    else {
+        memory_used += len;
+    }
+    uv_mutex_unlock(&mutex);
+
+    if (!spill) {
+        GifByteType *data = (GifByteType *)realloc(out, len > 0 ? len : 1); // give back the unused room
+        b->data = data ? data : out;
+        return;
+    }
+
+    // batches are written at offsets of their own, in any order
+    long long done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, out + done, len - done, offset + done);
+        if (n <= 0) {
+            free(out);
+            throw "Failed to write fragments to the spool in FragmentSpool::store.";
+        }
+        done += n;
+    }
+    free(out);
+    b->file_offset = offset;
+}
+
+GifByteType *
+FragmentSpool::grow(GifByteType *&buf, long long &size, long long n)
+{
+    if (n > size) {
+        if ((long long)(size_t)n != n) return NULL;
+        GifByteType *new_buf = (GifByteType *)realloc(buf, n);
+        if (!new_buf) return NULL;
+        buf = new_buf;
+        size = n;
+    }
+    return buf;
+}
+
+void
+FragmentSpool::take_fragments(std::vector<SpoolFragment> &out)
+{
+    out.clear();
+    out.swap(fragments);
+}
+
+const GifByteType *
+FragmentSpool::read(const SpoolFragment &fragment, SpoolReadBuffer &buf)
+{
+    const SpoolBatch *b = fragment.batch;
+    long long size = b->sizes[fragment.item];
+    int pixels = b->pixels[fragment.item];
+
+    const GifByteType *stored;
+    if (b->data) {
+        stored = b->data + b->offsets[fragment.item];
+    }
+    else {
+        // No stdio buffering, later batches may still be written to the
+        // file while earlier ones are read back, by several threads.
+        uv_mutex_lock(&mutex);
+        int file = fd;
+        uv_mutex_unlock(&mutex);
+        if (file == -1) return NULL;
+
+        if (!grow(buf.read_buf, buf.read_buf_size, size)) return NULL;
+        long long offset = b->file_offset + b->offsets[fragment.item];
+        long long done = 0;
+        while (done < size) {
+            ssize_t n = pread(file, buf.read_buf + done, size - done, offset + done);
+            if (n <= 0) return NULL;
+            done += n;
+        }
+        stored = buf.read_buf;
+    }
+    if (!b->deflated)
+        return stored;
+
+    if (!grow(buf.inflate_buf, buf.inflate_buf_size, pixels)) return NULL;
+    uLongf dest_len = pixels;
+    if (uncompress(buf.inflate_buf, &dest_len, stored, size) != Z_OK || (int)dest_len != pixels)
+        return NULL;
+    return buf.inflate_buf;
+}
+
+void
+FragmentSpool::close_file()
+{
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+void
+FragmentSpool::release(SpoolBatch *b)
+{
+    if (b->data) {
+        free(b->data);
+        b->data = NULL;
+        uv_mutex_lock(&mutex);
+        memory_used -= b->stored_len;
+        uv_mutex_unlock(&mutex);
+    }
+    b->released = true;
+
+    // batches are released about in the order they were filled
+    while (!batches.empty() && batches.front()->released) {
+        delete batches.front();
+        batches.pop_front();
+    }
+}
+
+long long
+FragmentSpool::memory_in_use()
+{
+    uv_mutex_lock(&mutex);
+    long long ret = memory_used;
+    uv_mutex_unlock(&mutex);
+    return ret;
+}
+
+long long
+FragmentSpool::bytes_spilled()
+{
+    uv_mutex_lock(&mutex);
+    long long ret = file_end;
+    uv_mutex_unlock(&mutex);
+    return ret;
+}
+
+long long
+FragmentSpool::bytes_pushed()
+{
+    uv_mutex_lock(&mutex);
+    long long ret = raw_bytes;
+    uv_mutex_unlock(&mutex);
+    return ret;
+}
+
+long long
+FragmentSpool::bytes_stored()
+{
+    uv_mutex_lock(&mutex);
+    long long ret = stored_bytes;
+    uv_mutex_unlock(&mutex);
+    return ret;
+}
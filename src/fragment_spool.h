@@ -0,0 +1,129 @@
+#ifndef FRAGMENT_SPOOL_H
+#define FRAGMENT_SPOOL_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <gif_lib.h>
+#include <uv.h>
+
+#include "common.h"
+
+struct SpoolBatch;
+
+struct SpoolFragment {
+    unsigned int push_id; // frame the fragment belongs to
+    Rect rect;
+    SpoolBatch *batch; // the fragment is item in this batch
+    int item;
+};
+
+// Fragments pushed one after another, about SPOOL_BATCH_SIZE bytes of them,
+// stored together. Pushing copies the pixels to raw. store() then maps them
+// to web safe palette indices, deflates them if asked to and keeps them in
+// data, or in the spool file if they don't fit in the memory budget.
+struct SpoolBatch {
+    unsigned char *raw;
+    long long raw_len, raw_size;
+    std::vector<int> pixels; // of every fragment
+
+    // the spool's settings when the batch was sealed, setting them again
+    // doesn't race with the worker storing it
+    int compression;
+    long long memory_budget;
+
+    GifByteType *data; // NULL while in raw or once in the file
+    long long file_offset;
+    // Byte counts are long long throughout, a single fragment can take
+    // more than an int holds once deflated or added to the batch.
+    std::vector<long long> offsets, sizes; // of the stored fragments
+    long long stored_len;
+    bool deflated;
+
+    // Kept by the owner of the spool, on its thread: the batch can be read
+    // once stored, and is freed once released.
+    bool stored, released;
+
+    SpoolBatch() : raw(NULL), raw_len(0), raw_size(0), compression(0), memory_budget(0),
+        data(NULL), file_offset(-1),
+        stored_len(0), deflated(false), stored(false), released(false) {}
+    ~SpoolBatch() { free(raw); free(data); }
+};
+
+// Room for fragments read back from the file or inflated, one per thread
+// reading.
+struct SpoolReadBuffer {
+    GifByteType *read_buf, *inflate_buf;
+    long long read_buf_size, inflate_buf_size;
+
+    SpoolReadBuffer() : read_buf(NULL), inflate_buf(NULL), read_buf_size(0), inflate_buf_size(0) {}
+    ~SpoolReadBuffer() { free(read_buf); free(inflate_buf); }
+};
+
+// Pushed fragments of an AsyncAnimatedGif, with which frame and rect every
+// one belongs to. Batches spilled to the file are appended one after
+// another, so reading the fragments back in push order mostly reads the
+// file from start to end.
+class FragmentSpool {
+    buffer_type buf_type;
+    // copied to every batch sealed
+    int compression; // zlib level, 0 for none
+    long long memory_budget;
+
+    std::vector<SpoolFragment> fragments; // appended since the last take
+    std::deque<SpoolBatch *> batches; // not released yet, oldest first
+    SpoolBatch *batch; // being filled, batches.back()
+    long long fragment_count;
+
+    // shared by the workers storing batches
+    uv_mutex_t mutex;
+    std::string dir;
+    int fd; // of the spool file, already unlinked
+    long long memory_used;
+    long long raw_bytes, stored_bytes;
+    long long file_end; // where the next spilled batch goes
+
+    void open_file();
+    static GifByteType *grow(GifByteType *&buf, long long &size, long long n);
+
+public:
+    FragmentSpool(buffer_type bbuf_type);
+    ~FragmentSpool();
+
+    void set_dir(const std::string &ddir);
+    void set_memory_budget(long long bytes) { memory_budget = bytes; }
+    void set_compression(int level) { compression = level; }
+
+    void append(unsigned int push_id, const Rect &rect, const unsigned char *data, int size);
+    bool batch_full() const;
+    bool batch_empty() const { return !batch || batch->pixels.empty(); }
+
+    // Takes the current batch off, to be stored, and starts a new one.
+    SpoolBatch *seal_batch();
+    // Quantizes, compresses and puts away a sealed batch. Can be called
+    // from any thread, for different batches at once.
+    void store(SpoolBatch *b);
+
+    // Moves the fragments appended since the last call to out.
+    void take_fragments(std::vector<SpoolFragment> &out);
+
+    // Palette indices of a fragment in a stored batch, possibly in buf,
+    // valid until buf is used again. Returns NULL if they can't be read.
+    const GifByteType *read(const SpoolFragment &fragment, SpoolReadBuffer &buf);
+    // Gives back the spool file's space once nothing is stored or read.
+    void close_file();
+
+    // Frees a batch whose fragments won't be read anymore.
+    void release(SpoolBatch *b);
+
+    long long fragments_pushed() const { return fragment_count; }
+    long long memory_in_use();
+    long long bytes_spilled();
+    long long bytes_pushed();
+    long long bytes_stored();
+};
+
+#define SPOOL_BATCH_SIZE (1024*1024)
+#define DEFAULT_SPOOL_MEMORY_BUDGET (64*1024*1024)
+
+#endif
@@ -17,11 +17,16 @@ Gif::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "encode", GifEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", GifEncodeSync);
     NODE_SET_PROTOTYPE_METHOD(t, "setTransparencyColor", SetTransparencyColor);
-    target->Set(String::NewSymbol("Gif"), t->GetFunction());
+    NODE_SET_PROTOTYPE_METHOD(t, "setPalette", SetPalette);
+    NODE_SET_PROTOTYPE_METHOD(t, "setStrips", SetStrips);
+    NODE_SET_PROTOTYPE_METHOD(t, "getStats", GetStats);
+    Local<Function> f = t->GetFunction();
+    NODE_SET_METHOD(f, "encodeBatch", GifEncodeBatch);
+    target->Set(String::NewSymbol("Gif"), f);
 }
 
 Gif::Gif(int wwidth, int hheight, buffer_type bbuf_type) :
-  width(wwidth), height(hheight), buf_type(bbuf_type) {}
+  width(wwidth), height(hheight), buf_type(bbuf_type), palette(PALETTE_WEB_SAFE), strips(1) {}
 
 Handle<Value>
 Gif::GifEncodeSync()
@@ -37,10 +42,13 @@ Gif::GifEncodeSync()
         if (transparency_color.color_present) {
             encoder.set_transparency_color(transparency_color);
         }
+        encoder.set_palette(palette);
+        encoder.set_strips(strips);
         encoder.encode();
+        stats = encoder.get_stats();
         int gif_len = encoder.get_gif_len();
-        Local<Object> retbuf = NanNewBufferHandle(gif_len);
-        memcpy(Buffer::Data(retbuf), encoder.get_gif(), gif_len);
+        Local<Object> retbuf = NanNewBufferHandle((char *)encoder.release_gif(), gif_len,
+            free_buffer_data, NULL);
         return scope.Close(retbuf);
     }
     catch (const char *err) {
@@ -54,6 +62,18 @@ Gif::SetTransparencyColor(unsigned char r, unsigned char g, unsigned char b)
     transparency_color = Color(r, g, b, true);
 }
 
+void
+Gif::SetPalette(palette_type ppalette)
+{
+    palette = ppalette;
+}
+
+void
+Gif::SetStrips(int sstrips)
+{
+    strips = sstrips;
+}
+
 NAN_METHOD(Gif::New)
 {
     NanScope();
@@ -95,10 +115,10 @@ NAN_METHOD(Gif::New)
     int w = args[1]->Int32Value();
     int h = args[2]->Int32Value();
 
-    if (w < 0)
-        return NanThrowRangeError("Width smaller than 0.");
-    if (h < 0)
-        return NanThrowRangeError("Height smaller than 0.");
+    if (w < 1)
+        return NanThrowRangeError("Width smaller than 1.");
+    if (h < 1)
+        return NanThrowRangeError("Height smaller than 1.");
 
     Gif *gif = new Gif(w, h, buf_type);
     gif->Wrap(args.This());
@@ -141,21 +161,77 @@ NAN_METHOD(Gif::SetTransparencyColor)
     NanReturnUndefined();
 }
 
+NAN_METHOD(Gif::SetPalette)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - 'websafe' or 'adaptive'.");
+    if (!args[0]->IsString())
+        return NanThrowTypeError("First argument must be 'websafe' or 'adaptive'.");
+
+    String::AsciiValue name(args[0]->ToString());
+    palette_type palette;
+    if (str_eq(*name, "websafe"))
+        palette = PALETTE_WEB_SAFE;
+    else if (str_eq(*name, "adaptive"))
+        palette = PALETTE_ADAPTIVE;
+    else
+        return NanThrowTypeError("First argument must be 'websafe' or 'adaptive'.");
+
+    Gif *gif = ObjectWrap::Unwrap<Gif>(args.This());
+    gif->SetPalette(palette);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(Gif::SetStrips)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - number of strips.");
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer number of strips.");
+
+    int strips = args[0]->Int32Value();
+    if (strips < 1)
+        return NanThrowRangeError("Number of strips smaller than 1.");
+    if (strips > MAX_STRIPS)
+        return NanThrowRangeError("Number of strips larger than " STRINGIFY(MAX_STRIPS) ".");
+
+    Gif *gif = ObjectWrap::Unwrap<Gif>(args.This());
+    gif->SetStrips(strips);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(Gif::GetStats)
+{
+    NanScope();
+
+    Gif *gif = ObjectWrap::Unwrap<Gif>(args.This());
+
+    Local<Object> ret = Object::New();
+    ret->Set(String::NewSymbol("frames"), Integer::New(gif->stats.frames));
+    ret->Set(String::NewSymbol("outputAllocs"), Integer::New(gif->stats.output_allocs));
+    ret->Set(String::NewSymbol("outputBytesCopied"), Number::New(gif->stats.output_bytes_copied));
+
+    NanReturnValue(ret);
+}
+
 void Gif::GifEncodeWorker::Execute() {
     try {
         GifEncoder encoder((unsigned char *)buf_data, gif_obj->width, gif_obj->height, gif_obj->buf_type);
         if (gif_obj->transparency_color.color_present) {
             encoder.set_transparency_color(gif_obj->transparency_color);
         }
+        encoder.set_palette(gif_obj->palette);
+        encoder.set_strips(gif_obj->strips);
         encoder.encode();
+        stats = encoder.get_stats();
         gif_len = encoder.get_gif_len();
-        gif = (char *)malloc(sizeof(*gif)*gif_len);
-        if (!gif) {
-            errmsg = strdup("malloc in Gif::GifEncodeWorker::Execute() failed.");
-        }
-        else {
-            memcpy(gif, encoder.get_gif(), gif_len);
-        }
+        gif = (char *)encoder.release_gif();
     }
     catch (const char *err) {
         errmsg = strdup(err);
@@ -165,8 +241,8 @@ void Gif::GifEncodeWorker::Execute() {
 void Gif::GifEncodeWorker::HandleOKCallback() {
     NanScope();
 
-    Local<Object> buf = NanNewBufferHandle(gif_len);
-    memcpy(Buffer::Data(buf), gif, gif_len);
+    Local<Object> buf = NanNewBufferHandle(gif, gif_len, free_buffer_data, NULL);
+    gif = NULL; // owned by buf now
     Local<Value> argv[2] = {buf, Undefined()};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -176,9 +252,7 @@ void Gif::GifEncodeWorker::HandleOKCallback() {
     if (try_catch.HasCaught())
         FatalException(try_catch);
 
-    free(gif);
-    gif = NULL;
-
+    gif_obj->stats = stats;
     gif_obj->Unref();
 }
 
@@ -222,3 +296,166 @@ NAN_METHOD(Gif::GifEncodeAsync)
 
     NanReturnUndefined();
 }
+
+// Images per batch chunk. Fewer images than this in a chunk aren't worth
+// another trip through the thread pool.
+#define BATCH_CHUNK_MIN 16
+#define BATCH_CHUNKS 4
+
+static bool
+parse_buffer_type(Handle<Value> val, buffer_type &buf_type)
+{
+    String::AsciiValue bts(val->ToString());
+    if (str_eq(*bts, "rgb"))
+        buf_type = BUF_RGB;
+    else if (str_eq(*bts, "bgr"))
+        buf_type = BUF_BGR;
+    else if (str_eq(*bts, "rgba"))
+        buf_type = BUF_RGBA;
+    else if (str_eq(*bts, "bgra"))
+        buf_type = BUF_BGRA;
+    else
+        return false;
+    return true;
+}
+
+void Gif::GifBatchWorker::Execute() {
+    for (int i = begin; i < end; i++) {
+        BatchImage &image = batch->images[i];
+        try {
+            GifEncoder encoder(image.data, image.width, image.height, image.buf_type);
+            encoder.encode();
+            image.gif_len = encoder.get_gif_len();
+            image.gif = (char *)encoder.release_gif();
+        }
+        catch (const char *err) {
+            image.errmsg = strdup(err);
+        }
+    }
+}
+
+void Gif::GifBatchWorker::HandleOKCallback() {
+    if (--batch->pending > 0)
+        return;
+
+    NanScope();
+
+    std::vector<BatchImage> &images = batch->images;
+    int failed = -1;
+    for (size_t i = 0; i < images.size(); i++) {
+        if (images[i].errmsg) {
+            failed = i;
+            break;
+        }
+    }
+
+    Local<Value> argv[2];
+    if (failed >= 0) {
+        argv[0] = Undefined();
+        argv[1] = Exception::Error(String::New(images[failed].errmsg));
+        for (size_t i = 0; i < images.size(); i++) {
+            free(images[i].gif);
+            free(images[i].errmsg);
+        }
+    }
+    else {
+        // the encoders' output becomes the Buffers, nothing is copied
+        Local<Array> gifs = Array::New(images.size());
+        for (size_t i = 0; i < images.size(); i++) {
+            gifs->Set(i, NanNewBufferHandle(images[i].gif, images[i].gif_len,
+                free_buffer_data, NULL));
+        }
+        argv[0] = gifs;
+        argv[1] = Undefined();
+    }
+
+    TryCatch try_catch; // don't quite see the necessity of this
+
+    batch->callback->Call(2, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    delete batch->callback;
+    delete batch;
+}
+
+NAN_METHOD(Gif::GifEncodeBatch)
+{
+    NanScope();
+
+    if (args.Length() != 2)
+        return NanThrowError("Two arguments required - array of images and callback function.");
+    if (!args[0]->IsArray())
+        return NanThrowTypeError("First argument must be an array of {buffer, width, height, [type]} objects.");
+    if (!args[1]->IsFunction())
+        return NanThrowTypeError("Second argument must be a function.");
+
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    int n = list->Length();
+
+    Batch *batch = new Batch;
+    batch->images.resize(n);
+    for (int i = 0; i < n; i++) {
+        BatchImage &image = batch->images[i];
+        image.gif = NULL;
+        image.gif_len = 0;
+        image.errmsg = NULL;
+
+        const char *err = NULL;
+        Local<Value> item = list->Get(i);
+        if (!item->IsObject()) {
+            err = "Every image must be a {buffer, width, height, [type]} object.";
+        }
+        else {
+            Local<Object> obj = item->ToObject();
+            Local<Value> buffer = obj->Get(String::NewSymbol("buffer"));
+            Local<Value> width = obj->Get(String::NewSymbol("width"));
+            Local<Value> height = obj->Get(String::NewSymbol("height"));
+            Local<Value> type = obj->Get(String::NewSymbol("type"));
+
+            image.buf_type = BUF_RGB;
+            if (!Buffer::HasInstance(buffer))
+                err = "Image buffer must be Buffer.";
+            else if (!width->IsInt32() || width->Int32Value() < 1)
+                err = "Image width must be a positive integer.";
+            else if (!height->IsInt32() || height->Int32Value() < 1)
+                err = "Image height must be a positive integer.";
+            else if (!type->IsUndefined() && !parse_buffer_type(type, image.buf_type))
+                err = "Image type must be 'rgb', 'bgr', 'rgba' or 'bgra'.";
+            else {
+                image.data = (unsigned char *)Buffer::Data(buffer->ToObject());
+                image.width = width->Int32Value();
+                image.height = height->Int32Value();
+                if ((long long)image.width*image.height*bytes_per_pixel(image.buf_type) >
+                    (long long)Buffer::Length(buffer->ToObject()))
+                {
+                    err = "Image buffer is smaller than width*height pixels.";
+                }
+            }
+        }
+
+        if (err) {
+            delete batch;
+            return NanThrowTypeError(err);
+        }
+    }
+
+    batch->callback = new NanCallback(Local<Function>::Cast(args[1]));
+
+    int chunk = (n + BATCH_CHUNKS - 1)/BATCH_CHUNKS;
+    if (chunk < BATCH_CHUNK_MIN)
+        chunk = BATCH_CHUNK_MIN;
+    batch->pending = n ? (n + chunk - 1)/chunk : 1;
+    Local<Object> images = list;
+    for (int i = 0; i < batch->pending; i++) {
+        int begin = i*chunk;
+        int end = begin + chunk < n ? begin + chunk : n;
+        GifBatchWorker *worker = new GifBatchWorker(batch, begin, end);
+        // keeps the input buffers alive until the chunk is done
+        worker->SavePersistent("images", images);
+        NanAsyncQueueWorker(worker);
+    }
+
+    NanReturnUndefined();
+}
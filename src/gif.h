@@ -1,6 +1,7 @@
 #ifndef NODE_GIF_H
 #define NODE_GIF_H
 
+#include <vector>
 #include <node.h>
 #include <node_buffer.h>
 
@@ -11,12 +12,17 @@ class Gif : public node::ObjectWrap {
     int width, height;
     buffer_type buf_type;
     Color transparency_color;
+    palette_type palette;
+    int strips;
+    EncoderStats stats; // of the last encode
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
     Gif(int wwidth, int hheight, buffer_type bbuf_type);
     v8::Handle<v8::Value> GifEncodeSync();
     void SetTransparencyColor(unsigned char r, unsigned char g, unsigned char b);
+    void SetPalette(palette_type ppalette);
+    void SetStrips(int sstrips);
 
     class GifEncodeWorker : public GifEncoder::EncodeWorker {
     public:
@@ -29,12 +35,47 @@ public:
 
     private:
         Gif *gif_obj;
+        EncoderStats stats;
+    };
+
+    // Gif.encodeBatch: the images are split into chunks, each encoded by
+    // a worker of its own, and the last chunk to finish calls back.
+    struct BatchImage {
+        unsigned char *data;
+        int width, height;
+        buffer_type buf_type;
+        char *gif;
+        int gif_len;
+        char *errmsg;
+    };
+
+    struct Batch {
+        std::vector<BatchImage> images;
+        int pending; // chunks not done yet
+        NanCallback *callback;
+    };
+
+    class GifBatchWorker : public NanAsyncWorker {
+    public:
+        GifBatchWorker(Batch *bbatch, int bbegin, int eend) :
+            NanAsyncWorker(NULL), batch(bbatch), begin(bbegin), end(eend) {};
+
+        void Execute();
+        void HandleOKCallback();
+
+    private:
+        Batch *batch;
+        int begin, end;
     };
 
     static NAN_METHOD(New);
     static NAN_METHOD(GifEncodeSync);
     static NAN_METHOD(GifEncodeAsync);
     static NAN_METHOD(SetTransparencyColor);
+    static NAN_METHOD(SetPalette);
+    static NAN_METHOD(SetStrips);
+    static NAN_METHOD(GetStats);
+    static NAN_METHOD(GifEncodeBatch);
 };
 
 #endif
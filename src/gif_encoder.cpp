@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <climits>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
@@ -6,11 +8,15 @@
 #include "gif_encoder.h"
 #include "palette.h"
 #include "quantize.h"
+#include "adaptive_quantize.h"
+#include "lzw.h"
+#include "parallel.h"
+#include "encoder_context.h"
 
 static int
 find_color_index(ColorMapObject *color_map, int color_map_size, Color &color)
 {
-    for (int i = 255; i >= 0; i--) { // cause our transparent color for now is at 255!
+    for (int i = color_map_size - 1; i >= 0; i--) { // cause our transparent color for now is at 255!
         /*
         printf("%d: %02x %02x %02x\n", i, color_map->Colors[i].Red,
             color_map->Colors[i].Green, color_map->Colors[i].Blue);
@@ -25,191 +31,374 @@ find_color_index(ColorMapObject *color_map, int color_map_size, Color &color)
     return -1;
 }
 
-GifImage::GifImage() : size(0), mem_size(0), gif(NULL) {}
-GifImage::~GifImage() { free(gif); }
-
-GifEncoder::GifEncoder(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type) :
-    data(ddata), width(wwidth), height(hheight), buf_type(bbuf_type) {}
-
-RGBator::RGBator(unsigned char *data, int width, int height, buffer_type buf_type) {
-    memory = (GifByteType *)malloc(sizeof(GifFileType)*width*height*3);
-    if (!memory) throw "malloc in RGBator::RGBator failed";
-    red = memory;
-    green = memory + width*height;
-    blue = memory + width*height*2;
-
-    switch (buf_type) {
-    case BUF_RGB:
-        rgb_to_rgb(data, width, height);
-        break;
-    case BUF_BGR:
-        bgr_to_rgb(data, width, height);
-        break;
-    case BUF_RGBA:
-        rgba_to_rgb(data, width, height);
-        break;
-    case BUF_BGRA:
-        bgra_to_rgb(data, width, height);
-        break;
-    default:
-        throw "Unexpected buf_type in RGBator::RGBator";
+// Writes the image data that follows EGifPutImageDesc, with our own LZW
+// encoder unless giflib's EGifPutLine was asked for.
+static int
+put_image_data(GifFileType *gif_file, LzwEncoder &lzw, GifByteType *buf,
+    int width, int height, int min_code_size)
+{
+    if (use_native_lzw()) {
+        lzw.encode(buf, width*height, min_code_size);
+        return lzw_put_blocks(gif_file, min_code_size, lzw.data(), lzw.size());
     }
+    for (int i = 0; i < height; i++) {
+        if (EGifPutLine(gif_file, buf, width) == GIF_ERROR)
+            return GIF_ERROR;
+        buf += width;
+    }
+    return GIF_OK;
+}
+
+// Writes the graphic control extension that makes transparent_idx
+// transparent in the image that follows, shown without delay.
+static int
+put_transparency(GifFileType *gif_file, int transparent_idx)
+{
+    char extension[] = {
+        1, // enable transparency
+        0, 0, // no time delay
+        (char)transparent_idx // transparency color index
+    };
+    return EGifPutExtension(gif_file, GRAPHICS_EXT_FUNC_CODE, 4, extension);
+}
+
+// Maps n pixels to a table of exactly their colors, padded to a valid
+// size, when there are no more than 256 of them. Returns NULL otherwise.
+static ColorMapObject *
+exact_color_map(unsigned char *data, int n, buffer_type buf_type, GifByteType *out,
+    Color &transparency_color, int &transparent_idx)
+{
+    GifColorType colors[256];
+    int ncolors = exact_quantize(data, n, buf_type, colors, out);
+    if (!ncolors)
+        return NULL;
+
+    int size = color_table_size(ncolors);
+    memset(colors + ncolors, 0, sizeof(*colors)*(size - ncolors));
+    ColorMapObject *color_map = MakeMapObject(size, colors);
+    if (!color_map)
+        throw "MakeMapObject in exact_color_map failed";
+    transparent_idx = -1;
+    if (transparency_color.color_present)
+        transparent_idx = find_color_index(color_map, ncolors, transparency_color);
+    return color_map;
+}
+
+// Replaces color_map with a smaller one if buf only uses a few of its
+// entries, which also shortens the LZW codes.
+static ColorMapObject *
+shrink_color_map(ColorMapObject *color_map, GifByteType *buf, int n, int &transparent_idx)
+{
+    int ncolors = compact_palette(buf, n, color_map->Colors, color_map->ColorCount, transparent_idx);
+    if (!ncolors)
+        return color_map;
+
+    int size = color_table_size(ncolors);
+    memset(color_map->Colors + ncolors, 0, sizeof(*color_map->Colors)*(size - ncolors));
+    ColorMapObject *small_map = MakeMapObject(size, color_map->Colors);
+    FreeMapObject(color_map);
+    if (!small_map)
+        throw "MakeMapObject in shrink_color_map failed";
+    return small_map;
+}
+
+// Work shared by the threads of a strip encode. Strip i covers rows
+// strip_top(i) up to strip_top(i + 1).
+struct StripJob {
+    unsigned char *data;
+    buffer_type buf_type;
+    GifByteType *buf;
+    int width, height, strips;
+    int min_code_size;
+    LzwEncoder **lzw;
+    const char **errors;
 };
 
-RGBator::~RGBator() { free(memory); }
+static int
+strip_top(int height, int strips, int i)
+{
+    return (int)((long long)height*i/strips);
+}
 
-void
-RGBator::rgb_to_rgb(unsigned char *data, int width, int height)
-{
-    GifByteType *datap = data;
-    GifByteType *rp = red, *gp = green, *bp = blue;
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height; j++) {
-            *rp++ = *datap++;
-            *gp++ = *datap++;
-            *bp++ = *datap++;
-        }
-    }
+static void
+quantize_strip(void *arg, int i)
+{
+    StripJob *job = (StripJob *)arg;
+    int top = strip_top(job->height, job->strips, i);
+    int rows = strip_top(job->height, job->strips, i + 1) - top;
+    web_safe_quantize(job->width, rows,
+        job->data + (size_t)top*job->width*bytes_per_pixel(job->buf_type),
+        job->buf_type, job->buf + (size_t)top*job->width);
 }
 
-void
-RGBator::bgr_to_rgb(unsigned char *data, int width, int height)
-{
-    GifByteType *datap = data;
-    GifByteType *rp = red, *gp = green, *bp = blue;
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height; j++) {
-            *rp++ = *(datap + 2);
-            *gp++ = *(datap + 1);
-            *bp++ = *datap;
-            datap += 3;
-        }
-    }
+static void
+feed_lzw(void *arg, const GifByteType *pixels, int n)
+{
+    ((LzwEncoder *)arg)->add(pixels, n);
 }
 
-void
-RGBator::rgba_to_rgb(unsigned char *data, int width, int height)
-{
-    GifByteType *datap = data;
-    GifByteType *rp = red, *gp = green, *bp = blue;
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height; j++) {
-            *rp++ = *datap++;
-            *gp++ = *datap++;
-            *bp++ = *datap++;
-            datap++;
-        }
+static void
+compress_strip(void *arg, int i)
+{
+    StripJob *job = (StripJob *)arg;
+    int top = strip_top(job->height, job->strips, i);
+    int rows = strip_top(job->height, job->strips, i + 1) - top;
+    try {
+        job->lzw[i]->encode(job->buf + (size_t)top*job->width, rows*job->width, job->min_code_size);
+    }
+    catch (const char *err) {
+        job->errors[i] = err;
     }
 }
 
+GifImage::GifImage() : size(0), mem_size(0), gif(NULL), allocs(0), bytes_copied(0) {}
+GifImage::~GifImage() { free(gif); }
+
 void
-RGBator::bgra_to_rgb(unsigned char *data, int width, int height)
-{
-    GifByteType *datap = data;
-    GifByteType *rp = red, *gp = green, *bp = blue;
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height; j++) {
-            *rp++ = *(datap + 2);
-            *gp++ = *(datap + 1);
-            *bp++ = *datap;
-            datap += 4;
-        }
+GifImage::reserve(int n)
+{
+    if (n <= mem_size) return;
+    GifByteType *new_ptr = (GifByteType *)realloc(gif, n);
+    if (!new_ptr)
+        throw "realloc in GifImage::reserve failed";
+    allocs++;
+    if (new_ptr != gif)
+        bytes_copied += size;
+    gif = new_ptr;
+    mem_size = n;
+}
+
+unsigned char *
+GifImage::release()
+{
+    unsigned char *ret = gif;
+    if (ret && size > 0 && size < mem_size) {
+        unsigned char *trimmed = (unsigned char *)realloc(ret, size);
+        if (trimmed)
+            ret = trimmed;
     }
+    gif = NULL;
+    size = mem_size = 0;
+    return ret;
+}
+
+int
+gif_size_estimate(int width, int height, int frames)
+{
+    // headers and a 256 color table, then per frame a control extension,
+    // an image descriptor, maybe a local table, and LZW data that is
+    // usually well under a byte per pixel
+    long long estimate = 800 + (long long)frames*(800 + (long long)width*height/4);
+    return estimate < (1 << 30) ? (int)estimate : 1 << 30;
 }
 
+GifEncoder::GifEncoder(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type) :
+    data(ddata), width(wwidth), height(hheight), buf_type(bbuf_type), palette(PALETTE_WEB_SAFE),
+    strips(1), context(NULL) {}
+
 int
 gif_writer(GifFileType *gif_file, const GifByteType *data, int size)
 {
     GifImage *gif = (GifImage *)gif_file->UserData;
-    if (gif->size + size > gif->mem_size) {
-        GifByteType *new_ptr = (GifByteType *)realloc(gif->gif, gif->size + size + 10*1024);
-        if (!new_ptr)
-            throw "realloc in gif_writer failed";
-        gif->gif = new_ptr;
-        gif->mem_size = gif->size + size + 10*1024;
+    long long needed = (long long)gif->size + size;
+    if (needed > gif->mem_size) {
+        // sizes are ints, doubling stops at the biggest one
+        if (needed > INT_MAX)
+            throw "GIF output over 2GB in gif_writer";
+        long long n = (long long)gif->mem_size*2;
+        if (n < needed)
+            n = needed;
+        if (n < 10*1024)
+            n = 10*1024;
+        gif->reserve((int)std::min(n, (long long)INT_MAX));
     }
     memcpy(gif->gif + gif->size, data, size);
     gif->size += size;
     return size;
 }
 
-void
-GifEncoder::encode()
+// Maps data to a palette, returned as a color map. May compress the image
+// while it is being mapped, in which case compressed is set and the
+// context's first LZW encoder holds it.
+ColorMapObject *
+GifEncoder::quantize(GifByteType *out, int &transparent_idx, bool &compressed)
 {
-    RGBator rgb(data, width, height, buf_type);
+    ColorMapObject *color_map;
+    transparent_idx = -1;
 
-    int color_map_size = 256;
-    ColorMapObject *output_color_map = MakeMapObject(256, ext_web_safe_palette);
-    if (!output_color_map) {
-        throw "MakeMapObject in GifEncoder::encode failed";
-    }
+    // few colors, keep them all
+    color_map = exact_color_map(data, width*height, buf_type, out, transparency_color,
+        transparent_idx);
+    if (color_map)
+        return color_map;
 
-    GifByteType *gif_buf = (GifByteType *)malloc(sizeof(GifByteType)*width*height);
-    if (!gif_buf) {
-        FreeMapObject(output_color_map);
-        throw "malloc in GifEncoder::encode failed";
+    if (palette == PALETTE_ADAPTIVE) {
+        AdaptiveQuantizer *quantizer = context->adaptive_quantizer();
+        quantizer->set_transparency_color(transparency_color);
+        quantizer->reset();
+        quantizer->add(data, width*height, buf_type);
+        quantizer->build_palette();
+        quantizer->map(data, width*height, buf_type, out);
+        transparent_idx = quantizer->transparent_index();
+        color_map = MakeMapObject(256, quantizer->colors());
+    }
+    else {
+        int nstrips = strip_count();
+        if (nstrips > 1) {
+            StripJob job = { data, buf_type, out, width, height, nstrips, 0, NULL, NULL };
+            run_parallel(nstrips, quantize_strip, &job);
+        }
+        else if (use_native_lzw() && get_quantize_threads() > 1) {
+            // Compress bands as they come out of the quantizer threads. Only
+            // valid if the color table doesn't shrink afterwards, see below.
+            LzwEncoder *lzw = context->lzw_encoder(0);
+            lzw->begin(width*height, 8);
+            web_safe_quantize_bands(width, height, data, buf_type, out, feed_lzw, lzw);
+            lzw->finish();
+            compressed = true;
+        }
+        else {
+            web_safe_quantize_bands(width, height, data, buf_type, out, NULL, NULL);
+        }
+        color_map = MakeMapObject(256, ext_web_safe_palette);
+        if (color_map && transparency_color.color_present)
+            transparent_idx = find_color_index(color_map, 256, transparency_color);
     }
 
-    if (web_safe_quantize(width, height, rgb.red, rgb.green, rgb.blue, gif_buf) == GIF_ERROR) {
-        FreeMapObject(output_color_map);
-        free(gif_buf);
-        throw "web_safe_quantize in GifEncoder::encode failed";
+    if (!color_map)
+        throw "MakeMapObject in GifEncoder::quantize failed";
+    color_map = shrink_color_map(color_map, out, width*height, transparent_idx);
+    if (compressed && color_map->ColorCount != 256)
+        compressed = false; // renumbered with shorter codes, compress it again
+    return color_map;
+}
+
+void
+GifEncoder::encode()
+{
+    context = acquire_encoder_context();
+    try {
+        encode_with_context();
+    }
+    catch (const char *) {
+        release_encoder_context(context);
+        context = NULL;
+        throw;
     }
+    release_encoder_context(context);
+    context = NULL;
+}
+
+void
+GifEncoder::encode_with_context()
+{
+    gif.reserve(gif_size_estimate(width, height, 1));
+
+    GifByteType *gif_buf = context->index_buffer(width*height);
+
+    int transparent_idx;
+    bool compressed = false;
+    ColorMapObject *output_color_map = quantize(gif_buf, transparent_idx, compressed);
 
     GifFileType *gif_file = EGifOpen(&gif, gif_writer);
     if (!gif_file) {
         FreeMapObject(output_color_map);
-        free(gif_buf);
         throw "EGifOpen in GifEncoder::encode failed";
     }
 
     if (EGifPutScreenDesc(gif_file, width, height,
-        color_map_size, 0, output_color_map) == GIF_ERROR)
+        8, 0, output_color_map) == GIF_ERROR) // 8 bits of color resolution
     {
         FreeMapObject(output_color_map);
-        free(gif_buf);
         EGifCloseFile(gif_file);
         throw "EGifPutScreenDesc in GifEncoder::encode failed";
     }
 
-    if (transparency_color.color_present) {
-        int i = find_color_index(output_color_map, color_map_size, transparency_color);
-        if (i) {
-            char extension[] = {
-                1, // enable transparency
-                0, 0, // no time delay
-                i // transparency color index
-            };
-            if (EGifPutExtension(gif_file, GRAPHICS_EXT_FUNC_CODE, 4, extension) == GIF_ERROR) {
-                FreeMapObject(output_color_map);
-                free(gif_buf);
-                EGifCloseFile(gif_file);
-                throw "EGifPutExtension in GifEncoder::encode failed";
-            }
-        }
+    try {
+        write_strips(gif_file, gif_buf, output_color_map, transparent_idx, compressed);
     }
-
-    if (EGifPutImageDesc(gif_file, 0, 0, width, height, FALSE, NULL) == GIF_ERROR) {
+    catch (const char *) {
         FreeMapObject(output_color_map);
-        free(gif_buf);
         EGifCloseFile(gif_file);
-        throw "EGifPutImageDesc in GifEncoder::encode failed";
+        throw;
     }
 
-    GifByteType *gif_bufp = gif_buf;
-    for (int i = 0; i < height; i++) {
-        if (EGifPutLine(gif_file, gif_bufp, width) == GIF_ERROR) {
-            FreeMapObject(output_color_map);
-            free(gif_buf);
-            EGifCloseFile(gif_file);
-            throw "EGifPutLine in GifEncoder::encode failed";
+    FreeMapObject(output_color_map);
+    EGifCloseFile(gif_file);
+}
+
+int
+GifEncoder::strip_count() const
+{
+    if (strips <= 1 || height <= 1)
+        return 1;
+    return strips < height ? strips : height;
+}
+
+// Writes gif_buf as strip_count() images stacked top to bottom, all sharing
+// the global color table. With more than one strip, the strips are
+// compressed in parallel and then written out in order. If compressed is
+// set, the single strip is already in the context's first LZW encoder.
+void
+GifEncoder::write_strips(GifFileType *gif_file, GifByteType *gif_buf,
+    ColorMapObject *color_map, int transparent_idx, bool compressed)
+{
+    int nstrips = strip_count();
+    int min_code_size = lzw_min_code_size(color_map);
+
+    // encoders holding finished strips, NULL where a strip is still to do
+    std::vector<LzwEncoder *> lzw(nstrips, (LzwEncoder *)NULL);
+    std::vector<const char *> errors(nstrips, (const char *)NULL);
+    if (compressed) {
+        lzw[0] = context->lzw_encoder(0);
+    }
+    else if (nstrips > 1 && use_native_lzw()) {
+        for (int i = 0; i < nstrips; i++)
+            lzw[i] = context->lzw_encoder(i);
+        StripJob job = { data, buf_type, gif_buf, width, height, nstrips,
+            min_code_size, &lzw[0], &errors[0] };
+        run_parallel(nstrips, compress_strip, &job);
+    }
+
+    const char *err = NULL;
+    for (int i = 0; i < nstrips; i++) {
+        if ((err = errors[i]))
+            break;
+        int top = strip_top(height, nstrips, i);
+        int rows = strip_top(height, nstrips, i + 1) - top;
+
+        if (transparent_idx >= 0 && put_transparency(gif_file, transparent_idx) == GIF_ERROR) {
+            err = "EGifPutExtension in GifEncoder::encode failed";
+            break;
+        }
+
+        if (EGifPutImageDesc(gif_file, 0, top, width, rows, FALSE, NULL) == GIF_ERROR) {
+            err = "EGifPutImageDesc in GifEncoder::encode failed";
+            break;
+        }
+
+        int ret;
+        if (lzw[i]) {
+            ret = lzw_put_blocks(gif_file, min_code_size, lzw[i]->data(), lzw[i]->size());
+        }
+        else {
+            try {
+                ret = put_image_data(gif_file, *context->lzw_encoder(0), gif_buf + (size_t)top*width,
+                    width, rows, min_code_size);
+            }
+            catch (const char *e) {
+                err = e;
+                break;
+            }
+        }
+        if (ret == GIF_ERROR) {
+            err = "EGifPutLine in GifEncoder::encode failed";
+            break;
         }
-        gif_bufp += width;
     }
 
-    FreeMapObject(output_color_map);
-    free(gif_buf);
-    EGifCloseFile(gif_file);
+    if (err)
+        throw err;
 }
 
 void
@@ -227,6 +416,18 @@ GifEncoder::set_transparency_color(const Color &c)
     transparency_color = c;
 }
 
+void
+GifEncoder::set_palette(palette_type ppalette)
+{
+    palette = ppalette;
+}
+
+void
+GifEncoder::set_strips(int sstrips)
+{
+    strips = sstrips;
+}
+
 const unsigned char *
 GifEncoder::get_gif() const
 {
@@ -239,18 +440,153 @@ GifEncoder::get_gif_len() const
     return gif.size;
 }
 
+unsigned char *
+GifEncoder::release_gif()
+{
+    return gif.release();
+}
+
+EncoderStats
+GifEncoder::get_stats() const
+{
+    EncoderStats ret;
+    ret.frames = 1;
+    ret.output_allocs = gif.allocs;
+    ret.output_bytes_copied = gif.bytes_copied;
+    return ret;
+}
+
+// Sparse Gif Encoder
+SparseGifEncoder::SparseGifEncoder(unsigned char *ddata, int wwidth, int hheight,
+    buffer_type bbuf_type) :
+    data(ddata), width(wwidth), height(hheight), buf_type(bbuf_type), context(NULL) {}
+
+void
+SparseGifEncoder::add_image(const Rect &rect)
+{
+    images.push_back(rect);
+}
+
+void
+SparseGifEncoder::set_transparency_color(const Color &c)
+{
+    transparency_color = c;
+}
+
+void
+SparseGifEncoder::encode()
+{
+    context = acquire_encoder_context();
+    try {
+        encode_with_context();
+    }
+    catch (const char *) {
+        release_encoder_context(context);
+        context = NULL;
+        throw;
+    }
+    release_encoder_context(context);
+    context = NULL;
+}
+
+void
+SparseGifEncoder::encode_with_context()
+{
+    int n = 0;
+    for (size_t i = 0; i < images.size(); i++)
+        n += images[i].w*images[i].h;
+    if (n == 0)
+        throw "SparseGifEncoder::encode has no images to encode";
+    gif.reserve(gif_size_estimate(n, 1, images.size()));
+
+    // all the images are quantized in one go
+    GifByteType *gif_buf = context->index_buffer(n);
+    int transparent_idx = -1;
+    ColorMapObject *color_map = exact_color_map(data, n, buf_type, gif_buf, transparency_color,
+        transparent_idx);
+    if (!color_map) {
+        web_safe_quantize(n, 1, data, buf_type, gif_buf);
+        color_map = MakeMapObject(256, ext_web_safe_palette);
+        if (!color_map)
+            throw "MakeMapObject in SparseGifEncoder::encode failed";
+        if (transparency_color.color_present)
+            transparent_idx = find_color_index(color_map, 256, transparency_color);
+        color_map = shrink_color_map(color_map, gif_buf, n, transparent_idx);
+    }
+    int min_code_size = lzw_min_code_size(color_map);
+
+    GifFileType *gif_file = EGifOpen(&gif, gif_writer);
+    if (!gif_file) {
+        FreeMapObject(color_map);
+        throw "EGifOpen in SparseGifEncoder::encode failed";
+    }
+
+    const char *err = NULL;
+    if (EGifPutScreenDesc(gif_file, width, height,
+        8, 0, color_map) == GIF_ERROR) // 8 bits of color resolution
+    {
+        err = "EGifPutScreenDesc in SparseGifEncoder::encode failed";
+    }
+
+    GifByteType *buf = gif_buf;
+    for (size_t i = 0; i < images.size() && !err; i++) {
+        const Rect &r = images[i];
+        if (transparent_idx >= 0 && put_transparency(gif_file, transparent_idx) == GIF_ERROR) {
+            err = "EGifPutExtension in SparseGifEncoder::encode failed";
+            break;
+        }
+
+        if (EGifPutImageDesc(gif_file, r.x, r.y, r.w, r.h, FALSE, NULL) == GIF_ERROR) {
+            err = "EGifPutImageDesc in SparseGifEncoder::encode failed";
+            break;
+        }
+        try {
+            if (put_image_data(gif_file, *context->lzw_encoder(0), buf, r.w, r.h,
+                min_code_size) == GIF_ERROR)
+            {
+                err = "EGifPutLine in SparseGifEncoder::encode failed";
+            }
+        }
+        catch (const char *e) {
+            err = e;
+        }
+        buf += r.w*r.h;
+    }
+
+    FreeMapObject(color_map);
+    EGifCloseFile(gif_file);
+    if (err)
+        throw err;
+}
+
+int
+SparseGifEncoder::get_gif_len() const
+{
+    return gif.size;
+}
+
+unsigned char *
+SparseGifEncoder::release_gif()
+{
+    return gif.release();
+}
+
 // Animated Gif Encoder
 AnimatedGifEncoder::AnimatedGifEncoder(int wwidth, int hheight, buffer_type bbuf_type) :
     width(wwidth), height(hheight), buf_type(bbuf_type),
     gif_buf(NULL), output_color_map(NULL), gif_file(NULL), color_map_size(256), write_func(0), write_user_data(0),
-    headers_set(false) {}
+    headers_set(false), palette(PALETTE_WEB_SAFE), quantizer(NULL), global_quantizer(NULL),
+    sample_frames(1), max_error(DEFAULT_MAX_ERROR), context(NULL), lzw(NULL),
+    delta_tolerance(-1), screen(NULL), duplicate_threshold(-1), holding(false) {}
 
 AnimatedGifEncoder::~AnimatedGifEncoder() { end_encoding(); }
 
 void
 AnimatedGifEncoder::end_encoding() {
-    free(gif_buf);
-    gif_buf = NULL;
+    if (holding) {
+        if (held.color_map) FreeMapObject(held.color_map);
+        holding = false;
+    }
     if (output_color_map) {
         FreeMapObject(output_color_map);
         output_color_map = NULL;
@@ -259,47 +595,112 @@ AnimatedGifEncoder::end_encoding() {
         EGifCloseFile(gif_file);
         gif_file = NULL;
     }
+    delete global_quantizer;
+    global_quantizer = NULL;
+    free(screen);
+    screen = NULL;
+    release_encoder_context(context);
+    context = NULL;
+    gif_buf = NULL;
+    quantizer = NULL;
+    lzw = NULL;
+    for (size_t i = 0; i < sample.size(); i++)
+        free(sample[i].data);
+    sample.clear();
 }
 
 void
-AnimatedGifEncoder::new_frame(unsigned char *data, int delay)
+AnimatedGifEncoder::open_output()
 {
-    if (!gif_file) {
-       if (write_func != NULL) {
-            gif_file = EGifOpen(write_user_data, write_func);
-            if (!gif_file) throw "EGifOpen in AnimatedGifEncoder::new_frame failed";
-        } else if (file_name.empty()) { // memory writer
-            gif_file = EGifOpen(&gif, gif_writer);
-            if (!gif_file) throw "EGifOpen in AnimatedGifEncoder::new_frame failed";
-        } else {
-            gif_file = EGifOpenFileName(file_name.c_str(), FALSE);
-            if (!gif_file) throw "EGifOpenFileName in AnimatedGifEncoder::new_frame failed";
-        }
-        output_color_map = MakeMapObject(color_map_size, ext_web_safe_palette);
-        if (!output_color_map) throw "MakeMapObject in AnimatedGifEncoder::new_frame failed";
+    if (gif_file) return;
 
-        gif_buf = (GifByteType *)malloc(sizeof(GifByteType)*width*height);
-        if (!gif_buf) throw "malloc in AnimatedGifEncoder::new_frame failed";
+    if (write_func != NULL) {
+        gif_file = EGifOpen(write_user_data, write_func);
+        if (!gif_file) throw "EGifOpen in AnimatedGifEncoder::new_frame failed";
+    } else if (file_name.empty()) { // memory writer
+        gif.reserve(gif_size_estimate(width, height, 1));
+        gif_file = EGifOpen(&gif, gif_writer);
+        if (!gif_file) throw "EGifOpen in AnimatedGifEncoder::new_frame failed";
+    } else {
+        gif_file = EGifOpenFileName(file_name.c_str(), FALSE);
+        if (!gif_file) throw "EGifOpenFileName in AnimatedGifEncoder::new_frame failed";
     }
 
-    RGBator rgb(data, width, height, buf_type);
+    context = acquire_encoder_context();
+    gif_buf = context->index_buffer(width*height);
+    lzw = context->lzw_encoder(0);
+}
+
+AdaptiveQuantizer *
+AnimatedGifEncoder::make_quantizer()
+{
+    AdaptiveQuantizer *q = new AdaptiveQuantizer();
+    if (transparency_color.color_present)
+        q->set_transparency_color(transparency_color);
+    return q;
+}
 
-    if (web_safe_quantize(width, height, rgb.red, rgb.green, rgb.blue, gif_buf) == GIF_ERROR)
-        throw "web_safe_quantize in AnimatedGifEncoder::new_frame failed";
+// Quantizes data with a palette of its own, returned as a color map.
+ColorMapObject *
+AnimatedGifEncoder::local_quantize(unsigned char *data, int &transparent_idx)
+{
+    int n = frame_rect.w*frame_rect.h;
+    ColorMapObject *color_map = exact_color_map(data, n, buf_type, gif_buf, transparency_color,
+        transparent_idx);
+    if (color_map)
+        return color_map;
 
-    /*
-    if (QuantizeBuffer(width, height, &color_map_size,
-        rgb.red, rgb.green, rgb.blue,
-        gif_buf, output_color_map->Colors) == GIF_ERROR)
-    {
-        throw "QuantizeBuffer in AnimatedGifEncoder::new_frame failed";
+    if (!quantizer) {
+        quantizer = context->adaptive_quantizer();
+        quantizer->set_transparency_color(transparency_color);
     }
-    */
+    quantizer->reset();
+    quantizer->add(data, n, buf_type);
+    quantizer->build_palette();
+    quantizer->map(data, n, buf_type, gif_buf);
+    transparent_idx = quantizer->transparent_index();
+
+    color_map = MakeMapObject(color_map_size, quantizer->colors());
+    if (!color_map) throw "MakeMapObject in AnimatedGifEncoder::new_frame failed";
+    return shrink_color_map(color_map, gif_buf, n, transparent_idx);
+}
+
+// Queues the frame in gif_buf (frame_rect of the screen) to be written.
+// Takes ownership of frame_color_map, which is written as the local color
+// table when given. If compressed is set, lzw already holds the frame's
+// image data. With duplicate elision the frame is held back until the next
+// one turns out to be different, as a duplicate adds to its delay.
+void
+AnimatedGifEncoder::write_frame(ColorMapObject *frame_color_map, int transparent_idx, int delay,
+    bool compressed)
+{
+    held.color_map = frame_color_map;
+    held.transparent_idx = transparent_idx;
+    held.delay = delay;
+    held.compressed = compressed;
+    held.rect = frame_rect;
+    holding = true;
+    if (duplicate_threshold < 0)
+        write_held();
+}
+
+// Writes out the held frame, if there is one. gif_buf and lzw are still
+// the frame's, so this has to happen before the next one is quantized.
+void
+AnimatedGifEncoder::write_held()
+{
+    if (!holding) return;
+    holding = false;
+    ColorMapObject *frame_color_map = held.color_map;
+    int transparent_idx = held.transparent_idx;
+    int delay = held.delay;
+    const Rect &rect = held.rect;
 
     if (!headers_set) {
         if (EGifPutScreenDesc(gif_file, width, height,
-            color_map_size, 0, output_color_map) == GIF_ERROR)
+            8, 0, output_color_map) == GIF_ERROR) // 8 bits of color resolution
         {
+            if (frame_color_map) FreeMapObject(frame_color_map);
             throw "EGifPutScreenDesc in AnimatedGifEncoder::new_frame failed";
         }
         char netscape_extension[] = "NETSCAPE2.0";
@@ -311,37 +712,418 @@ AnimatedGifEncoder::new_frame(unsigned char *data, int delay)
 
     char frame_flags = 1 << 2;
     char transp_color_idx = 0;
-    if (transparency_color.color_present) {
-        int i = find_color_index(output_color_map, color_map_size, transparency_color);
-        if (i>=0) {
-            frame_flags |= 1;
-            transp_color_idx = i;
-        }
+    if (transparent_idx >= 0) {
+        frame_flags |= 1;
+        transp_color_idx = transparent_idx;
     }
 
     char extension[] = {
         frame_flags,
-        delay%256, delay/256,
+        (char)(delay%256), (char)(delay/256),
         transp_color_idx
     };
     EGifPutExtension(gif_file, GRAPHICS_EXT_FUNC_CODE, 4, extension);
 
-    if (EGifPutImageDesc(gif_file, 0, 0, width, height, FALSE, NULL) == GIF_ERROR) {
+    int min_code_size = lzw_min_code_size(frame_color_map ? frame_color_map : output_color_map);
+    int ret = EGifPutImageDesc(gif_file, rect.x, rect.y, rect.w, rect.h, FALSE, frame_color_map);
+    if (frame_color_map) {
+        FreeMapObject(frame_color_map);
+        stats.local_color_tables++;
+    }
+    if (ret == GIF_ERROR) {
         throw "EGifPutImageDesc in AnimatedGifEncoder::new_frame failed";
     }
 
-    GifByteType *gif_bufp = gif_buf;
-    for (int i = 0; i < height; i++) {
-        if (EGifPutLine(gif_file, gif_bufp, width) == GIF_ERROR) {
-            throw "EGifPutLine in AnimatedGifEncoder::new_frame failed";
+    if (held.compressed)
+        ret = lzw_put_blocks(gif_file, min_code_size, lzw->data(), lzw->size());
+    else
+        ret = put_image_data(gif_file, *lzw, gif_buf, rect.w, rect.h, min_code_size);
+    if (ret == GIF_ERROR) {
+        throw "EGifPutLine in AnimatedGifEncoder::new_frame failed";
+    }
+    stats.frames++;
+    if (rect.w != width || rect.h != height)
+        stats.cropped_frames++;
+}
+
+// Maps the frame to the global palette, falling back to a local color
+// table when the mean squared error gets over max_error.
+void
+AnimatedGifEncoder::global_frame(unsigned char *data, int delay)
+{
+    write_held();
+
+    int n = frame_rect.w*frame_rect.h;
+    unsigned long long error = global_quantizer->map(data, n, buf_type, gif_buf);
+    int transparent_idx = global_quantizer->transparent_index();
+
+    ColorMapObject *frame_color_map = NULL;
+    if (error > (unsigned long long)max_error*n)
+        frame_color_map = local_quantize(data, transparent_idx);
+
+    write_frame(frame_color_map, transparent_idx, delay);
+}
+
+// Builds the global palette from the sampled frames and writes them out.
+void
+AnimatedGifEncoder::flush_sample()
+{
+    global_quantizer->build_palette();
+    output_color_map = MakeMapObject(color_map_size, global_quantizer->colors());
+    if (!output_color_map) throw "MakeMapObject in AnimatedGifEncoder::new_frame failed";
+
+    for (size_t i = 0; i < sample.size(); i++) {
+        frame_rect = sample[i].rect;
+        global_frame(sample[i].data, sample[i].delay);
+        free(sample[i].data);
+        sample[i].data = NULL;
+    }
+    sample.clear();
+}
+
+// The margin around a damage box would mostly be long runs of the
+// transparent index, which LZW packs into a few codes. Unless it is over a
+// quarter of the frame, the smaller image isn't worth the copy.
+static bool
+worth_cropping(const Rect &r, int width, int height)
+{
+    return (long long)r.w*r.h*4 <= (long long)width*height*3;
+}
+
+// Bounding box of the pixels of a frame that change the screen, grown one
+// pixel at a time as the rows are scanned top to bottom.
+struct ChangedBox {
+    int x0, y0, x1, y1;
+
+    ChangedBox(int width, int height) : x0(width), y0(height), x1(-1), y1(-1) {}
+
+    inline void add(int x, int y) {
+        if (x < x0) x0 = x;
+        if (x > x1) x1 = x;
+        if (y < y0) y0 = y;
+        y1 = y;
+    }
+
+    // What to write of a frame scanned in r. With nothing changed, a single
+    // transparent pixel still carries the delay; a box that leaves too
+    // little out falls back to the whole frame.
+    Rect frame_rect(const Rect &r, int width, int height) const {
+        if (x1 < 0)
+            return Rect(r.x < width ? r.x : 0, r.y < height ? r.y : 0, 1, 1);
+        Rect box(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+        return worth_cropping(box, width, height) ? box : Rect(0, 0, width, height);
+    }
+};
+
+// The transparency color as laid out in buf_type pixels.
+void
+AnimatedGifEncoder::transparency_bytes(unsigned char *c) const
+{
+    bool bgr = buf_type == BUF_BGR || buf_type == BUF_BGRA;
+    c[0] = bgr ? transparency_color.b : transparency_color.r;
+    c[1] = transparency_color.g;
+    c[2] = bgr ? transparency_color.r : transparency_color.b;
+}
+
+static inline bool
+same_color(const unsigned char *p, const unsigned char *q)
+{
+    return p[0] == q[0] && p[1] == q[1] && p[2] == q[2];
+}
+
+static inline bool
+close_color(const unsigned char *p, const unsigned char *q, int tolerance)
+{
+    return abs(p[0] - q[0]) <= tolerance && abs(p[1] - q[1]) <= tolerance &&
+        abs(p[2] - q[2]) <= tolerance;
+}
+
+// Bounding box of the pixels in dirty (or the whole frame) that change the
+// screen, as frames are never disposed: the ones that aren't the
+// transparency color and, when the screen is kept, aren't what is already
+// there (within the delta tolerance). Their number goes to changed. Falls
+// back to the whole frame when the box leaves too little of it out to pay
+// for the copy.
+Rect
+AnimatedGifEncoder::damage_rect(const unsigned char *data, const Rect *dirty,
+    long long &changed) const
+{
+    Rect r = dirty ? *dirty : Rect(0, 0, width, height);
+    if (!transparency_color.color_present)
+        return r;
+
+    int bpp = bytes_per_pixel(buf_type);
+    unsigned char c[3];
+    transparency_bytes(c);
+    int tolerance = delta_tolerance > 0 ? delta_tolerance : 0;
+
+    ChangedBox box(width, height);
+    for (int y = r.y; y < r.y + r.h; y++) {
+        long long i = (long long)y*width + r.x;
+        const unsigned char *p = data + i*bpp;
+        const unsigned char *s = screen ? screen + i*3 : NULL;
+        for (int x = r.x; x < r.x + r.w; x++, p += bpp) {
+            if (same_color(p, c))
+                continue;
+            if (s) {
+                const unsigned char *sp = s + (x - r.x)*3;
+                if (!same_color(sp, c) && close_color(p, sp, tolerance))
+                    continue;
+            }
+            changed++;
+            box.add(x, y);
+        }
+    }
+    return box.frame_rect(r, width, height);
+}
+
+// Unchanged pixels only become transparent in runs at least this long.
+// Between changed pixels, a few transparent ones cut up the color runs LZW
+// would otherwise find, and terminal text ends up bigger than without them.
+#define MIN_TRANSPARENT_RUN 32
+
+// Copies frame_rect out of data into the context's crop buffer. With a
+// delta tolerance, runs of pixels close to what is on screen become the
+// transparency color, which makes long runs for LZW, and the rest are
+// recorded as the new screen.
+unsigned char *
+AnimatedGifEncoder::crop(const unsigned char *data)
+{
+    int bpp = bytes_per_pixel(buf_type);
+    int row = frame_rect.w*bpp;
+    unsigned char *out = context->crop_buffer(row*frame_rect.h);
+    if (!screen) {
+        for (int y = 0; y < frame_rect.h; y++) {
+            memcpy(out + y*row,
+                data + ((long long)(frame_rect.y + y)*width + frame_rect.x)*bpp, row);
+        }
+        return out;
+    }
+
+    unsigned char c[3];
+    transparency_bytes(c);
+    unsigned char *o = out;
+    for (int y = 0; y < frame_rect.h; y++) {
+        long long i = (long long)(frame_rect.y + y)*width + frame_rect.x;
+        const unsigned char *p = data + i*bpp;
+        unsigned char *s = screen + i*3;
+        int x = 0;
+        while (x < frame_rect.w) {
+            // the run of pixels up to the next one that changes the screen
+            int end = x;
+            for (; end < frame_rect.w; end++) {
+                const unsigned char *pe = p + (end - x)*bpp, *se = s + (end - x)*3;
+                if (!same_color(pe, c) &&
+                    !(delta_tolerance >= 0 && !same_color(se, c) && close_color(pe, se, delta_tolerance)))
+                {
+                    break;
+                }
+            }
+            bool clear = end - x >= MIN_TRANSPARENT_RUN;
+            if (end < frame_rect.w)
+                end++; // and the changed pixel itself
+            for (; x < end; x++, p += bpp, s += 3, o += bpp) {
+                memcpy(o, p, bpp);
+                if (same_color(p, c))
+                    continue;
+                if (clear && close_color(p, s, delta_tolerance) && !same_color(s, c)) {
+                    memcpy(o, c, 3);
+                    stats.unchanged_pixels++;
+                    continue;
+                }
+                memcpy(s, p, 3);
+            }
+        }
+    }
+    return out;
+}
+
+void
+AnimatedGifEncoder::new_frame(unsigned char *data, int delay, const Rect *dirty)
+{
+    // The first frame always covers the whole screen, some decoders paint
+    // the background from it.
+    bool first = !gif_file;
+    open_output();
+
+    if ((delta_tolerance >= 0 || duplicate_threshold >= 0) &&
+        transparency_color.color_present && !screen)
+    {
+        screen = (unsigned char *)malloc(width*height*3);
+        if (!screen) throw "malloc in AnimatedGifEncoder::new_frame failed";
+        unsigned char c[3];
+        transparency_bytes(c);
+        for (int i = 0; i < width*height; i++)
+            memcpy(screen + i*3, c, 3);
+    }
+
+    long long changed = 0;
+    frame_rect = first ? Rect(0, 0, width, height) : damage_rect(data, dirty, changed);
+    // a duplicate can only go into a frame that isn't written out yet: one
+    // still sampled for the global palette or the held one. Without a
+    // transparency color there is no screen to compare with, nothing is
+    // elided.
+    if (!first && screen && duplicate_threshold >= 0 && changed <= duplicate_threshold &&
+        (holding || !sample.empty()))
+    {
+        // not worth a frame of its own, the last one is shown longer
+        int &last_delay = sample.empty() ? held.delay : sample.back().delay;
+        last_delay = std::min(last_delay + delay, 0xffff);
+        stats.elided_frames++;
+        return;
+    }
+    if (screen || frame_rect.w != width || frame_rect.h != height)
+        data = crop(data);
+    int n = frame_rect.w*frame_rect.h;
+
+    if (palette == PALETTE_GLOBAL) {
+        if (output_color_map) {
+            global_frame(data, delay);
+            return;
+        }
+
+        // still sampling colors for the global palette
+        if (!global_quantizer)
+            global_quantizer = make_quantizer();
+        global_quantizer->add(data, n, buf_type);
+
+        int size = n*bytes_per_pixel(buf_type);
+        SampledFrame frame;
+        frame.data = (unsigned char *)malloc(size);
+        if (!frame.data) throw "malloc in AnimatedGifEncoder::new_frame failed";
+        memcpy(frame.data, data, size);
+        frame.delay = delay;
+        frame.rect = frame_rect;
+        sample.push_back(frame);
+
+        if ((int)sample.size() >= sample_frames)
+            flush_sample();
+        return;
+    }
+
+    write_held();
+
+    ColorMapObject *frame_color_map = NULL; // local color table, if this frame needs one
+    int transparent_idx = -1;
+    bool compressed = false;
+    if (palette == PALETTE_ADAPTIVE) {
+        // the first frame's palette becomes the global one
+        ColorMapObject *color_map = local_quantize(data, transparent_idx);
+        if (!output_color_map)
+            output_color_map = color_map;
+        else
+            frame_color_map = color_map;
+    }
+    else {
+        if (!output_color_map) {
+            output_color_map = MakeMapObject(color_map_size, ext_web_safe_palette);
+            if (!output_color_map) throw "MakeMapObject in AnimatedGifEncoder::new_frame failed";
+        }
+        // a frame of a few flat colors keeps them, in a table of its own
+        frame_color_map = exact_color_map(data, n, buf_type, gif_buf, transparency_color,
+            transparent_idx);
+        if (!frame_color_map) {
+            if (use_native_lzw() && get_quantize_threads() > 1) {
+                // the table is fixed, so bands can be compressed as they come
+                lzw->begin(n, lzw_min_code_size(output_color_map));
+                web_safe_quantize_bands(frame_rect.w, frame_rect.h, data, buf_type, gif_buf,
+                    feed_lzw, lzw);
+                lzw->finish();
+                compressed = true;
+            }
+            else {
+                web_safe_quantize_bands(frame_rect.w, frame_rect.h, data, buf_type, gif_buf,
+                    NULL, NULL);
+            }
+            if (transparency_color.color_present)
+                transparent_idx = find_color_index(output_color_map, color_map_size,
+                    transparency_color);
+        }
+    }
+
+    write_frame(frame_color_map, transparent_idx, delay, compressed);
+}
+
+void
+AnimatedGifEncoder::prepare_indexed_frame(const GifByteType *indices, const Rect *dirty,
+    bool first, IndexedFrame &frame) const
+{
+    if (palette != PALETTE_WEB_SAFE)
+        throw "AnimatedGifEncoder::prepare_indexed_frame only works with the web safe palette";
+    int transparent_idx = web_safe_transparent_index();
+
+    Rect full(0, 0, width, height);
+    frame.rect = full;
+    if (!first && transparent_idx >= 0) {
+        Rect r = dirty ? *dirty : full;
+        ChangedBox box(width, height);
+        for (int y = r.y; y < r.y + r.h; y++) {
+            const GifByteType *p = indices + (long long)y*width;
+            for (int x = r.x; x < r.x + r.w; x++) {
+                if (p[x] != transparent_idx)
+                    box.add(x, y);
+            }
         }
-        gif_bufp += width;
+        frame.rect = box.frame_rect(r, width, height);
+    }
+
+    const Rect &r = frame.rect;
+    int n = r.w*r.h;
+    frame.compressed = use_native_lzw();
+    if (frame.compressed && r.w == width) { // the rows are one piece already
+        frame.lzw.encode(indices + (long long)r.y*width, n, 8); // 256 colors
+        return;
+    }
+
+    if (n > frame.indices_size) {
+        GifByteType *new_indices = (GifByteType *)realloc(frame.indices, n);
+        if (!new_indices) throw "realloc in AnimatedGifEncoder::prepare_indexed_frame failed";
+        frame.indices = new_indices;
+        frame.indices_size = n;
+    }
+    for (int y = 0; y < r.h; y++)
+        memcpy(frame.indices + y*r.w, indices + (long long)(r.y + y)*width + r.x, r.w);
+    if (frame.compressed)
+        frame.lzw.encode(frame.indices, n, 8);
+}
+
+void
+AnimatedGifEncoder::put_indexed_frame(IndexedFrame &frame, int delay)
+{
+    if (palette != PALETTE_WEB_SAFE)
+        throw "AnimatedGifEncoder::put_indexed_frame only works with the web safe palette";
+
+    open_output();
+    if (!output_color_map) {
+        output_color_map = MakeMapObject(color_map_size, ext_web_safe_palette);
+        if (!output_color_map) throw "MakeMapObject in AnimatedGifEncoder::new_frame failed";
     }
+
+    write_held();
+    frame_rect = frame.rect;
+    if (frame.compressed) {
+        lzw->swap(frame.lzw); // the frame gets the old code stream's buffer to reuse
+    }
+    else {
+        memcpy(gif_buf, frame.indices, frame_rect.w*frame_rect.h);
+    }
+    write_frame(NULL, web_safe_transparent_index(), delay, frame.compressed);
+}
+
+int
+AnimatedGifEncoder::web_safe_transparent_index() const
+{
+    if (!transparency_color.color_present)
+        return -1;
+    return web_safe_color_index(transparency_color.r, transparency_color.g, transparency_color.b);
 }
 
 void
 AnimatedGifEncoder::finish()
 {
+    if (!sample.empty())
+        flush_sample();
+    write_held();
     end_encoding();
 }
 
@@ -360,6 +1142,41 @@ AnimatedGifEncoder::set_transparency_color(const Color &c)
     transparency_color = c;
 }
 
+void
+AnimatedGifEncoder::set_delta_tolerance(int ttolerance)
+{
+    delta_tolerance = ttolerance;
+}
+
+void
+AnimatedGifEncoder::set_duplicate_threshold(int tthreshold)
+{
+    duplicate_threshold = tthreshold;
+}
+
+void
+AnimatedGifEncoder::set_palette(palette_type ppalette)
+{
+    palette = ppalette;
+}
+
+void
+AnimatedGifEncoder::set_global_palette(int ssample_frames, int mmax_error)
+{
+    palette = PALETTE_GLOBAL;
+    sample_frames = ssample_frames;
+    max_error = mmax_error;
+}
+
+EncoderStats
+AnimatedGifEncoder::get_stats() const
+{
+    EncoderStats ret = stats;
+    ret.output_allocs = gif.allocs;
+    ret.output_bytes_copied = gif.bytes_copied;
+    return ret;
+}
+
 unsigned char *
 AnimatedGifEncoder::get_gif() const
 {
@@ -372,6 +1189,12 @@ AnimatedGifEncoder::get_gif_len() const
     return gif.size;
 }
 
+unsigned char *
+AnimatedGifEncoder::release_gif()
+{
+    return gif.release();
+}
+
 void
 AnimatedGifEncoder::set_output_file(const char *ffile_name)
 {
@@ -2,9 +2,11 @@
 #define GIF_ENCODER_H
 
 #include <string>
+#include <vector>
 #include <gif_lib.h>
 
 #include "common.h"
+#include "lzw.h"
 
 #ifndef FALSE
     #define FALSE (0)
@@ -14,32 +16,78 @@
     #define TRUE (!FALSE)
 #endif
 
+// In-memory output. Grows geometrically, so writing n bytes costs O(n)
+// copying no matter how small the writes are.
 struct GifImage {
     int size, mem_size;
     unsigned char *gif;
+    int allocs;              // (re)allocations of gif
+    long long bytes_copied;  // bytes moved by reallocs that didn't grow in place
 
     GifImage();
     ~GifImage();
+    void reserve(int n);
+    // Hands over gif, trimmed to size, to be freed with free(); the image
+    // is empty afterwards.
+    unsigned char *release();
 };
 
 int gif_writer(GifFileType *gif_file, const GifByteType *data, int size);
 
+// Rough encoded size of frames frames of width x height, used to size the
+// first allocation of the output.
+int gif_size_estimate(int width, int height, int frames);
+
+class AdaptiveQuantizer;
+class LzwEncoder;
+class EncoderContext;
+
+struct EncoderStats {
+    int frames;
+    int local_color_tables;
+    int cropped_frames; // written as a sub-image smaller than the screen
+    long long unchanged_pixels; // made transparent as they were close to the screen
+    int elided_frames; // duplicates that went into the previous frame's delay
+    int output_allocs;
+    long long output_bytes_copied;
+
+    EncoderStats() : frames(0), local_color_tables(0), cropped_frames(0), unchanged_pixels(0),
+        elided_frames(0), output_allocs(0), output_bytes_copied(0) {}
+};
+
+#define MAX_STRIPS 64
+
 class GifEncoder {
     unsigned char *data;
     int width, height;
     buffer_type buf_type;
     GifImage gif;
     Color transparency_color;
+    palette_type palette;
+    int strips;
+    EncoderContext *context; // borrowed from the pool during encode()
+
+    void encode_with_context();
+    ColorMapObject *quantize(GifByteType *out, int &transparent_idx, bool &compressed);
+    int strip_count() const;
+    void write_strips(GifFileType *gif_file, GifByteType *gif_buf,
+        ColorMapObject *color_map, int transparent_idx, bool compressed);
 
 public:
     GifEncoder(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type);
 
     void set_transparency_color(unsigned char r, unsigned char g, unsigned char b);
     void set_transparency_color(const Color &c);
+    void set_palette(palette_type ppalette);
+    // Splits the image into this many horizontal strips, written as
+    // separate images and compressed on threads of their own.
+    void set_strips(int sstrips);
 
     void encode();
     const unsigned char *get_gif() const;
     int get_gif_len() const;
+    unsigned char *release_gif();
+    EncoderStats get_stats() const;
 
     class EncodeWorker : public NanAsyncWorker {
     public:
@@ -52,6 +100,46 @@ public:
     };
 };
 
+// A single frame made of separate images, each covering only its own rect
+// of the logical screen, which stays transparent everywhere else. data
+// holds the images one after another, in the order they are added. All of
+// them share one palette: their own colors if there are no more than 256
+// of them, the web safe palette otherwise.
+class SparseGifEncoder {
+    unsigned char *data;
+    int width, height;
+    buffer_type buf_type;
+    std::vector<Rect> images;
+    GifImage gif;
+    Color transparency_color;
+    EncoderContext *context; // borrowed from the pool during encode()
+
+    void encode_with_context();
+
+public:
+    SparseGifEncoder(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type);
+
+    void add_image(const Rect &rect);
+    void set_transparency_color(const Color &c);
+
+    void encode();
+    int get_gif_len() const;
+    unsigned char *release_gif();
+};
+
+// A frame of web safe palette indices cropped and compressed by
+// AnimatedGifEncoder::prepare_indexed_frame, waiting to be put.
+struct IndexedFrame {
+    Rect rect;
+    LzwEncoder lzw;
+    GifByteType *indices; // the cropped frame, when giflib compresses it
+    int indices_size;
+    bool compressed;
+
+    IndexedFrame() : indices(NULL), indices_size(0), compressed(false) {}
+    ~IndexedFrame() { free(indices); }
+};
+
 class AnimatedGifEncoder {
     int width, height;
     buffer_type buf_type;
@@ -67,10 +155,68 @@ class AnimatedGifEncoder {
     bool headers_set;
     Color transparency_color;
 
+    palette_type palette;
+    AdaptiveQuantizer *quantizer;
+
+    // PALETTE_GLOBAL: the global palette is built from the first
+    // sample_frames frames, later frames get a local color table once their
+    // mean squared error against it gets over max_error.
+    struct SampledFrame {
+        unsigned char *data;
+        int delay;
+        Rect rect;
+    };
+    AdaptiveQuantizer *global_quantizer;
+    std::vector<SampledFrame> sample;
+    int sample_frames, max_error;
+
+    // borrowed from the pool while encoding; gif_buf, quantizer and lzw
+    // belong to it
+    EncoderContext *context;
+    LzwEncoder *lzw;
+
+    // Part of the screen the frame being written covers. Everything outside
+    // it stays as the previous frames left it.
+    Rect frame_rect;
+
+    // With delta_tolerance >= 0, the last color written at every pixel
+    // (3 bytes in buf_type's order, the transparency color where nothing
+    // was) so pixels that are within the tolerance of it on every channel
+    // can be left transparent.
+    int delta_tolerance;
+    unsigned char *screen;
+
+    // Frames that change at most duplicate_threshold pixels of the screen
+    // only add their delay to the previous frame, which is held back until
+    // a different one comes.
+    struct HeldFrame {
+        ColorMapObject *color_map;
+        int transparent_idx, delay;
+        bool compressed;
+        Rect rect;
+    };
+    int duplicate_threshold;
+    HeldFrame held;
+    bool holding;
+
+    EncoderStats stats;
     std::string file_name;
 
     void end_encoding();
+    void open_output();
+    AdaptiveQuantizer *make_quantizer();
+    void transparency_bytes(unsigned char *c) const;
+    Rect damage_rect(const unsigned char *data, const Rect *dirty, long long &changed) const;
+    unsigned char *crop(const unsigned char *data);
+    ColorMapObject *local_quantize(unsigned char *data, int &transparent_idx);
+    void write_frame(ColorMapObject *frame_color_map, int transparent_idx, int delay,
+        bool compressed=false);
+    void write_held();
+    void global_frame(unsigned char *data, int delay);
+    void flush_sample();
 public:
+    static const int DEFAULT_MAX_ERROR = 100;
+
     AnimatedGifEncoder(int wwidth, int hheight, buffer_type bbuf_type);
     ~AnimatedGifEncoder();
 
@@ -87,30 +233,37 @@ public:
         char *buf_data;
     };
 
-    void new_frame(unsigned char *data, int delay=0); // delay in 1/100s of a second
+    // delay in 1/100s of a second. dirty, when given, is the only part of
+    // data that can hold anything but the transparency color.
+    void new_frame(unsigned char *data, int delay=0, const Rect *dirty=NULL);
+
+    // new_frame in two steps, for frames already mapped to the web safe
+    // palette with web_safe_transparent_index() where nothing was drawn.
+    // prepare_indexed_frame only reads the encoder's settings, so frames can
+    // be prepared on several threads at once while earlier ones are put.
+    // Frames must be put in order; first tells the first one, which is
+    // never cropped.
+    void prepare_indexed_frame(const GifByteType *indices, const Rect *dirty, bool first,
+        IndexedFrame &frame) const;
+    void put_indexed_frame(IndexedFrame &frame, int delay=0);
+    int web_safe_transparent_index() const;
     void finish();
 
     void set_transparency_color(unsigned char r, unsigned char g, unsigned char b);
     void set_transparency_color(const Color &c);
+    void set_palette(palette_type ppalette);
+    void set_delta_tolerance(int ttolerance); // -1 turns it off
+    void set_duplicate_threshold(int tthreshold); // -1 turns it off, needs a transparency color
+    void set_global_palette(int ssample_frames, int mmax_error);
+
+    EncoderStats get_stats() const;
 
     void set_output_file(const char *ffile_name);
     void set_output_func(OutputFunc func, void* user_data);
 
     unsigned char *get_gif() const;
     int get_gif_len() const;
-};
-
-class RGBator {
-    GifByteType *memory;
-
-    void rgb_to_rgb(unsigned char *data, int width, int height);
-    void bgr_to_rgb(unsigned char *data, int width, int height);
-    void rgba_to_rgb(unsigned char *data, int width, int height);
-    void bgra_to_rgb(unsigned char *data, int width, int height);
-public:
-    GifByteType *red, *green, *blue;
-    RGBator(unsigned char *data, int width, int height, buffer_type buf_type);
-    ~RGBator();
+    unsigned char *release_gif();
 };
 
 #endif
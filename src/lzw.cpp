@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <uv.h>
+
+#include "common.h"
+#include "lzw.h"
+
+#define LZ_MAX_CODE 4095 // biggest code possible in 12 bits
+
+// Packs codes LSB first into a 64 bit accumulator and spills it four bytes
+// at a time into sub-blocks of at most 255 bytes. Lives on the stack of
+// add() and finish() so the hot loop works on locals.
+struct BlockWriter {
+    unsigned long long acc;
+    int nbits;
+    GifByteType *out, *block;
+    int block_len;
+
+    inline void put_byte(GifByteType b) {
+        if (block_len == 255) {
+            *block = 255;
+            block = out++;
+            block_len = 0;
+        }
+        *out++ = b;
+        block_len++;
+    }
+
+    inline void put_code(int code, int bits) {
+        acc |= (unsigned long long)code << nbits;
+        nbits += bits;
+        if (nbits >= 32) {
+            put_byte(acc);
+            put_byte(acc >> 8);
+            put_byte(acc >> 16);
+            put_byte(acc >> 24);
+            acc >>= 32;
+            nbits -= 32;
+        }
+    }
+
+    void flush() {
+        while (nbits > 0) {
+            put_byte(acc);
+            acc >>= 8;
+            nbits -= 8;
+        }
+        *block = block_len;
+    }
+};
+
+// same code width bookkeeping as giflib's EGifCompressOutput
+#define OUTPUT(code) do { \
+        w.put_code((code), running_bits); \
+        if (running_code >= max_code1 && (code) <= LZ_MAX_CODE) \
+            max_code1 = 1 << ++running_bits; \
+    } while (0)
+
+#define LOAD_WRITER(w) \
+    BlockWriter w = { acc, nbits, buf + len, buf + block, block_len }
+
+#define SAVE_WRITER(w) do { \
+        acc = w.acc; \
+        nbits = w.nbits; \
+        len = w.out - buf; \
+        block = w.block - buf; \
+        block_len = w.block_len; \
+    } while (0)
+
+LzwEncoder::LzwEncoder() : buf(NULL), len(0), capacity(0)
+{
+    table = (unsigned int *)malloc(sizeof(*table)*TABLE_SIZE);
+    if (!table) throw "malloc in LzwEncoder::LzwEncoder failed";
+}
+
+LzwEncoder::~LzwEncoder()
+{
+    free(table);
+    free(buf);
+}
+
+void
+LzwEncoder::reserve(int n)
+{
+    if (n <= capacity) return;
+    GifByteType *new_buf = (GifByteType *)realloc(buf, n);
+    if (!new_buf) throw "realloc in LzwEncoder::reserve failed";
+    buf = new_buf;
+    capacity = n;
+}
+
+void
+LzwEncoder::reserve_pixels(int n)
+{
+    // At worst every pixel is a 12 bit code of its own, and the table is
+    // cleared at most every 256 codes. Add the sub-block length bytes.
+    long long bytes = ((long long)(n + n/256 + 4)*12 + 7)/8;
+    reserve(bytes + bytes/255 + 1);
+}
+
+void
+LzwEncoder::begin(int n, int mmin_code_size)
+{
+    reserve_pixels(n);
+
+    min_code_size = mmin_code_size;
+    clear_code = 1 << min_code_size;
+    eof_code = clear_code + 1;
+    running_code = eof_code + 1;
+    running_bits = min_code_size + 1;
+    max_code1 = 1 << running_bits;
+    crnt = -1;
+
+    acc = 0;
+    nbits = 0;
+    block = 0;
+    block_len = 0;
+    len = 1; // room for the first block's length byte
+
+    memset(table, 0xff, sizeof(*table)*TABLE_SIZE);
+    LOAD_WRITER(w);
+    OUTPUT(clear_code);
+    SAVE_WRITER(w);
+}
+
+void
+LzwEncoder::add(const GifByteType *pixels, int n)
+{
+    if (n <= 0) return;
+
+    LOAD_WRITER(w);
+    int i = 0;
+    if (crnt < 0)
+        crnt = pixels[i++];
+    for (; i < n; i++) {
+        int pixel = pixels[i];
+        unsigned int key = crnt << 8 | pixel;
+        unsigned int slot = (key*2654435761u) >> (32 - TABLE_BITS);
+        unsigned int entry;
+        while ((entry = table[slot]) != ~0u && (entry >> 12) != key)
+            slot = (slot + 1) & (TABLE_SIZE - 1);
+        if (entry != ~0u) {
+            crnt = entry & 0xfff;
+            continue;
+        }
+
+        OUTPUT(crnt);
+        crnt = pixel;
+
+        if (running_code >= LZ_MAX_CODE) {
+            OUTPUT(clear_code);
+            running_code = eof_code + 1;
+            running_bits = min_code_size + 1;
+            max_code1 = 1 << running_bits;
+            memset(table, 0xff, sizeof(*table)*TABLE_SIZE);
+        }
+        else {
+            table[slot] = key << 12 | running_code++;
+        }
+    }
+    SAVE_WRITER(w);
+}
+
+void
+LzwEncoder::finish()
+{
+    LOAD_WRITER(w);
+    if (crnt >= 0)
+        OUTPUT(crnt);
+    OUTPUT(eof_code);
+    w.flush();
+    SAVE_WRITER(w);
+}
+
+#undef SAVE_WRITER
+#undef LOAD_WRITER
+#undef OUTPUT
+
+void
+LzwEncoder::encode(const GifByteType *pixels, int n, int mmin_code_size)
+{
+    begin(n, mmin_code_size);
+    add(pixels, n);
+    finish();
+}
+
+void
+LzwEncoder::swap(LzwEncoder &other)
+{
+    std::swap(table, other.table);
+    std::swap(buf, other.buf);
+    std::swap(len, other.len);
+    std::swap(capacity, other.capacity);
+    std::swap(min_code_size, other.min_code_size);
+    std::swap(clear_code, other.clear_code);
+    std::swap(eof_code, other.eof_code);
+    std::swap(running_code, other.running_code);
+    std::swap(running_bits, other.running_bits);
+    std::swap(max_code1, other.max_code1);
+    std::swap(crnt, other.crnt);
+    std::swap(acc, other.acc);
+    std::swap(nbits, other.nbits);
+    std::swap(block, other.block);
+    std::swap(block_len, other.block_len);
+}
+
+int
+lzw_put_blocks(GifFileType *gif_file, int min_code_size, const GifByteType *blocks, int size)
+{
+    const GifByteType *p = blocks, *end = blocks + size;
+    if (p < end) {
+        if (EGifPutCode(gif_file, min_code_size, p) == GIF_ERROR)
+            return GIF_ERROR;
+        p += p[0] + 1;
+    }
+    for (; p < end; p += p[0] + 1) {
+        if (EGifPutCodeNext(gif_file, p) == GIF_ERROR)
+            return GIF_ERROR;
+    }
+    return EGifPutCodeNext(gif_file, NULL); // block terminator
+}
+
+int
+lzw_min_code_size(const ColorMapObject *color_map)
+{
+    return color_map->BitsPerPixel < 2 ? 2 : color_map->BitsPerPixel;
+}
+
+// Set from the main thread while encoders on other threads read it.
+static struct LzwSetting {
+    uv_mutex_t mutex;
+    bool native;
+
+    LzwSetting() : native(true) { uv_mutex_init(&mutex); }
+} setting;
+
+bool
+set_lzw_encoder(const char *name)
+{
+    bool native;
+    if (str_eq(name, "native"))
+        native = true;
+    else if (str_eq(name, "giflib"))
+        native = false;
+    else
+        return false;
+    uv_mutex_lock(&setting.mutex);
+    setting.native = native;
+    uv_mutex_unlock(&setting.mutex);
+    return true;
+}
+
+const char *
+get_lzw_encoder()
+{
+    return use_native_lzw() ? "native" : "giflib";
+}
+
+bool
+use_native_lzw()
+{
+    uv_mutex_lock(&setting.mutex);
+    bool ret = setting.native;
+    uv_mutex_unlock(&setting.mutex);
+    return ret;
+}
+
@@ -0,0 +1,64 @@
+#ifndef LZW_H
+#define LZW_H
+
+#include <cstddef>
+#include <gif_lib.h>
+
+// GIF flavoured LZW over a whole index buffer. Produces exactly the code
+// stream giflib's EGifPutLine does, already cut into data sub-blocks
+// (a length byte followed by up to 255 bytes), so it can be handed to
+// EGifPutCode/EGifPutCodeNext.
+class LzwEncoder {
+    static const int TABLE_BITS = 13;
+    static const int TABLE_SIZE = 1 << TABLE_BITS;
+
+    unsigned int *table; // (prefix << 8 | pixel) << 12 | code, ~0 when free
+    GifByteType *buf;
+    int len, capacity;
+
+    // code stream state kept between add() calls
+    int min_code_size, clear_code, eof_code;
+    int running_code, running_bits, max_code1;
+    int crnt; // code of the string matched so far, -1 before the first pixel
+    unsigned long long acc;
+    int nbits, block, block_len;
+
+    void reserve(int n);
+
+public:
+    LzwEncoder();
+    ~LzwEncoder();
+
+    // Sizes the output buffer for n pixels ahead of time.
+    void reserve_pixels(int n);
+
+    // The pixels can be fed in pieces: begin() with the total pixel count,
+    // add() them in order, then finish().
+    void begin(int n, int mmin_code_size);
+    void add(const GifByteType *pixels, int n);
+    void finish();
+
+    void encode(const GifByteType *pixels, int n, int mmin_code_size);
+
+    // Trades everything, the finished code stream included, with other.
+    void swap(LzwEncoder &other);
+
+    const GifByteType *data() const { return buf; }
+    int size() const { return len; }
+
+    // Bytes allocated, the table and the output buffer.
+    size_t memory() const { return sizeof(*table)*TABLE_SIZE + capacity; }
+};
+
+// Writes the sub-blocks and the block terminator after EGifPutImageDesc.
+int lzw_put_blocks(GifFileType *gif_file, int min_code_size, const GifByteType *blocks, int size);
+
+// Minimum code size giflib writes for a color map with EGifPutImageDesc.
+int lzw_min_code_size(const ColorMapObject *color_map);
+
+bool set_lzw_encoder(const char *name);
+const char *get_lzw_encoder();
+bool use_native_lzw();
+
+#endif
+
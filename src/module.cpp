@@ -5,9 +5,119 @@
 #include "dynamic_gif_stack.h"
 #include "animated_gif.h"
 #include "async_animated_gif.h"
+#include "quantize.h"
+#include "lzw.h"
+#include "encoder_context.h"
 
 using namespace v8;
 
+NAN_METHOD(SetQuantizeKernel)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - kernel name.");
+    if (!args[0]->IsString())
+        return NanThrowTypeError("First argument must be 'auto', 'avx2', 'sse2', 'scalar' or 'reference'.");
+
+    String::AsciiValue name(args[0]->ToString());
+    NanReturnValue(Boolean::New(set_quantize_kernel(*name)));
+}
+
+NAN_METHOD(GetQuantizeKernel)
+{
+    NanScope();
+
+    NanReturnValue(String::New(get_quantize_kernel()));
+}
+
+NAN_METHOD(SetQuantizeThreads)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - number of threads.");
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer number of threads.");
+
+    NanReturnValue(Boolean::New(set_quantize_threads(args[0]->Int32Value())));
+}
+
+NAN_METHOD(GetQuantizeThreads)
+{
+    NanScope();
+
+    NanReturnValue(Integer::New(get_quantize_threads()));
+}
+
+NAN_METHOD(SetLzwEncoder)
+{
+    NanScope();
+
+    if (args.Length() != 1)
+        return NanThrowError("One argument required - encoder name.");
+    if (!args[0]->IsString())
+        return NanThrowTypeError("First argument must be 'native' or 'giflib'.");
+
+    String::AsciiValue name(args[0]->ToString());
+    NanReturnValue(Boolean::New(set_lzw_encoder(*name)));
+}
+
+NAN_METHOD(GetLzwEncoder)
+{
+    NanScope();
+
+    NanReturnValue(String::New(get_lzw_encoder()));
+}
+
+NAN_METHOD(ReserveEncoderContexts)
+{
+    NanScope();
+
+    if (args.Length() != 3)
+        return NanThrowError("Three arguments required - count, max width, max height.");
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer count.");
+    if (!args[1]->IsInt32())
+        return NanThrowTypeError("Second argument must be integer max width.");
+    if (!args[2]->IsInt32())
+        return NanThrowTypeError("Third argument must be integer max height.");
+
+    int count = args[0]->Int32Value();
+    int width = args[1]->Int32Value();
+    int height = args[2]->Int32Value();
+    if (count < 0 || count > MAX_IDLE_CONTEXTS)
+        return NanThrowRangeError("Count must be between 0 and " STRINGIFY(MAX_IDLE_CONTEXTS) ".");
+    if (width < 0)
+        return NanThrowRangeError("Width smaller than 0.");
+    if (height < 0)
+        return NanThrowRangeError("Height smaller than 0.");
+
+    try {
+        reserve_encoder_contexts(count, width, height);
+    }
+    catch (const char *err) {
+        return NanThrowError(err);
+    }
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(GetEncoderContextStats)
+{
+    NanScope();
+
+    EncoderContextStats stats = get_encoder_context_stats();
+
+    Local<Object> ret = Object::New();
+    ret->Set(String::NewSymbol("hits"), Integer::New(stats.hits));
+    ret->Set(String::NewSymbol("misses"), Integer::New(stats.misses));
+    ret->Set(String::NewSymbol("idle"), Integer::New(stats.idle));
+    ret->Set(String::NewSymbol("idleBytes"), Number::New(stats.idle_bytes));
+
+    NanReturnValue(ret);
+}
+
 extern "C" void
 init(Handle<Object> target)
 {
@@ -17,6 +127,14 @@ init(Handle<Object> target)
     DynamicGifStack::Initialize(target);
     AnimatedGif::Initialize(target);
     AsyncAnimatedGif::Initialize(target);
+    NODE_SET_METHOD(target, "setQuantizeKernel", SetQuantizeKernel);
+    NODE_SET_METHOD(target, "getQuantizeKernel", GetQuantizeKernel);
+    NODE_SET_METHOD(target, "setQuantizeThreads", SetQuantizeThreads);
+    NODE_SET_METHOD(target, "getQuantizeThreads", GetQuantizeThreads);
+    NODE_SET_METHOD(target, "setLzwEncoder", SetLzwEncoder);
+    NODE_SET_METHOD(target, "getLzwEncoder", GetLzwEncoder);
+    NODE_SET_METHOD(target, "reserveEncoderContexts", ReserveEncoderContexts);
+    NODE_SET_METHOD(target, "getEncoderContextStats", GetEncoderContextStats);
 }
 
 NODE_MODULE(gif, init)
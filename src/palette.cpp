@@ -53,6 +53,65 @@ GifColorType ext_web_safe_palette[256] = {
     { 0xff, 0xff, 0xfe }
 };
 
+// Inverse colormap for ext_web_safe_palette. The first 216 entries form a
+// 6x6x6 grid, so their nearest entry is found channel by channel. The
+// distance to a gray only depends on r+g+b beyond a common term, so the
+// nearest gray is looked up by that sum. Ties go to the higher index, just
+// like in find_closest_color.
+static unsigned char web_safe_level[256];
+static unsigned char web_safe_gray[3*255 + 1];
+
+static struct WebSafeTables {
+    WebSafeTables() {
+        for (int c = 0; c < 256; c++)
+            web_safe_level[c] = (c + 25)/51;
+
+        for (int sum = 0; sum <= 3*255; sum++) {
+            int best = -1, idx = 216;
+            for (int i = 216; i < 255; i++) {
+                int v = ext_web_safe_palette[i].Red;
+                int dist = 3*v*v - 2*v*sum;
+                if (best == -1 || dist <= best) {
+                    best = dist;
+                    idx = i;
+                }
+            }
+            web_safe_gray[sum] = idx;
+        }
+    }
+} web_safe_tables;
+
+static inline int
+color_dist(int i, int r, int g, int b)
+{
+    int dr = ext_web_safe_palette[i].Red - r;
+    int dg = ext_web_safe_palette[i].Green - g;
+    int db = ext_web_safe_palette[i].Blue - b;
+    return dr*dr + dg*dg + db*db;
+}
+
+int
+web_safe_color_index(int r, int g, int b)
+{
+    int rl = web_safe_level[r], gl = web_safe_level[g], bl = web_safe_level[b];
+    int idx = rl*36 + gl*6 + bl;
+    int dr = r - rl*51, dg = g - gl*51, db = b - bl*51;
+    int best = dr*dr + dg*dg + db*db;
+
+    int gray = web_safe_gray[r + g + b];
+    int dist = color_dist(gray, r, g, b);
+    if (dist <= best) {
+        best = dist;
+        idx = gray;
+    }
+
+    // transparent color
+    if (color_dist(255, r, g, b) <= best)
+        idx = 255;
+
+    return idx;
+}
+
 int
 find_closest_color(int r, int g, int b)
 {
@@ -6,6 +6,7 @@
 extern GifColorType ext_web_safe_palette[256];
 
 int find_closest_color(int r, int g, int b);
+int web_safe_color_index(int r, int g, int b);
 
 #endif
 
@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <deque>
+#include <uv.h>
+
+#include "parallel.h"
+
+// A run_parallel call. Tasks 1 .. n-1 are handed out in order, to the
+// pool's threads and to the calling thread once it is done with task 0.
+struct Job {
+    parallel_func func;
+    void *arg;
+    int n;
+    int next; // first task nobody has taken yet
+    int done; // of tasks 1 .. n-1
+    uv_cond_t done_cond;
+};
+
+// Threads that live as long as the process, started as they are first
+// needed, no more than one less than there are cores.
+static struct Pool {
+    uv_mutex_t mutex;
+    uv_cond_t work_cond;
+    std::deque<Job *> jobs; // with tasks left to hand out, oldest first
+    int threads, max_threads;
+
+    Pool() : threads(0), max_threads(-1) {
+        uv_mutex_init(&mutex);
+        uv_cond_init(&work_cond);
+    }
+} pool;
+
+int
+parallel_cores()
+{
+    static int cores = 0;
+    if (!cores) {
+        uv_cpu_info_t *infos = NULL;
+        int count = 0;
+        uv_cpu_info(&infos, &count);
+        if (infos)
+            uv_free_cpu_info(infos, count);
+        cores = count > 0 ? count : 1;
+    }
+    return cores;
+}
+
+// With the pool's mutex held. Returns -1 if the job has no tasks left.
+static int
+take_task(Job *job)
+{
+    if (job->next >= job->n)
+        return -1;
+    int i = job->next++;
+    if (job->next == job->n)
+        pool.jobs.erase(std::find(pool.jobs.begin(), pool.jobs.end(), job));
+    return i;
+}
+
+// With the pool's mutex held, around running task i.
+static void
+run_task(Job *job, int i)
+{
+    uv_mutex_unlock(&pool.mutex);
+    job->func(job->arg, i);
+    uv_mutex_lock(&pool.mutex);
+    if (++job->done == job->n - 1)
+        uv_cond_signal(&job->done_cond);
+}
+
+static void
+worker(void *)
+{
+    uv_mutex_lock(&pool.mutex);
+    for (;;) {
+        while (pool.jobs.empty())
+            uv_cond_wait(&pool.work_cond, &pool.mutex);
+        Job *job = pool.jobs.front();
+        run_task(job, take_task(job));
+    }
+}
+
+// With the pool's mutex held.
+static void
+start_threads(int wanted)
+{
+    if (pool.max_threads < 0)
+        pool.max_threads = std::min(parallel_cores() - 1, MAX_PARALLEL_THREADS);
+    while (pool.threads < std::min(wanted, pool.max_threads)) {
+        uv_thread_t thread;
+        if (uv_thread_create(&thread, worker, NULL) != 0) {
+            pool.max_threads = pool.threads; // don't try again
+            break;
+        }
+        pool.threads++;
+    }
+}
+
+void
+run_parallel(int n, parallel_func func, void *arg)
+{
+    if (n <= 0) return;
+    if (n == 1) {
+        func(arg, 0);
+        return;
+    }
+
+    Job job;
+    job.func = func;
+    job.arg = arg;
+    job.n = n;
+    job.next = 1;
+    job.done = 0;
+    uv_cond_init(&job.done_cond);
+
+    uv_mutex_lock(&pool.mutex);
+    start_threads(n - 1);
+    pool.jobs.push_back(&job);
+    uv_cond_broadcast(&pool.work_cond);
+    uv_mutex_unlock(&pool.mutex);
+
+    func(arg, 0);
+
+    // whatever the pool hasn't taken yet runs here
+    uv_mutex_lock(&pool.mutex);
+    int i;
+    while ((i = take_task(&job)) >= 0)
+        run_task(&job, i);
+    while (job.done < n - 1)
+        uv_cond_wait(&job.done_cond, &pool.mutex);
+    uv_mutex_unlock(&pool.mutex);
+
+    uv_cond_destroy(&job.done_cond);
+}
@@ -0,0 +1,17 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+typedef void (*parallel_func)(void *arg, int i);
+
+// Calls func(arg, i) for i = 0 .. n-1 and returns once all of them are
+// done. The calling thread takes i = 0, the rest go to a pool of threads
+// kept for the next call, one less than there are cores. Tasks the pool
+// has no thread for yet run on the calling thread after its own.
+void run_parallel(int n, parallel_func func, void *arg);
+
+// Number of cores, at least 1.
+int parallel_cores();
+
+#define MAX_PARALLEL_THREADS 63
+
+#endif
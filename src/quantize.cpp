@@ -1,41 +1,397 @@
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <cassert>
+#include <cstring>
 #include <map>
+#include <uv.h>
 
 #include "common.h"
 #include "quantize.h"
 #include "palette.h"
+#include "parallel.h"
+
+// What web_safe_quantize did before the inverse colormap: the nearest
+// color search, cached per call. Kept to check the kernels and to time
+// them against.
+static void
+web_safe_quantize_reference(const unsigned char *data, int n,
+    buffer_type buf_type, GifByteType *out)
+{
+    typedef std::map<int, char> IdxCache;
+    IdxCache cache;
+
+    int bpp = bytes_per_pixel(buf_type);
+    bool bgr = buf_type == BUF_BGR || buf_type == BUF_BGRA;
+    for (int i = 0; i < n; i++, data += bpp) {
+        int r = bgr ? data[2] : data[0], g = data[1], b = bgr ? data[0] : data[2];
+        IdxCache::iterator idx = cache.find(r<<16 | g<<8 | b);
+        if (idx != cache.end()) {
+            *out++ = idx->second;
+            continue;
+        }
+        *out = find_closest_color(r, g, b);
+        cache[r<<16 | g<<8 | b] = *out;
+        out++;
+    }
+}
+
+static void
+web_safe_quantize_scalar(const unsigned char *data, int n,
+    buffer_type buf_type, GifByteType *out)
+{
+    switch (buf_type) {
+    case BUF_RGB:
+        for (int i = 0; i < n; i++, data += 3)
+            *out++ = web_safe_color_index(data[0], data[1], data[2]);
+        break;
+    case BUF_BGR:
+        for (int i = 0; i < n; i++, data += 3)
+            *out++ = web_safe_color_index(data[2], data[1], data[0]);
+        break;
+    case BUF_RGBA:
+        for (int i = 0; i < n; i++, data += 4)
+            *out++ = web_safe_color_index(data[0], data[1], data[2]);
+        break;
+    case BUF_BGRA:
+        for (int i = 0; i < n; i++, data += 4)
+            *out++ = web_safe_color_index(data[2], data[1], data[0]);
+        break;
+    }
+}
+
+struct QuantizeKernel {
+    const char *name;
+    quantize_kernel func;
+    bool (*supported)();
+};
+
+static bool always() { return true; }
+
+#ifdef QUANTIZE_X86
+static bool has_sse2() { __builtin_cpu_init(); return __builtin_cpu_supports("sse2"); }
+static bool has_avx2() { __builtin_cpu_init(); return __builtin_cpu_supports("avx2"); }
+#endif
+
+// fastest first
+static const QuantizeKernel kernels[] = {
+#ifdef QUANTIZE_X86
+    { "avx2", web_safe_quantize_avx2, has_avx2 },
+    { "sse2", web_safe_quantize_sse2, has_sse2 },
+#endif
+    { "scalar", web_safe_quantize_scalar, always },
+    { "reference", web_safe_quantize_reference, always }
+};
+
+static const int nkernels = sizeof(kernels)/sizeof(kernels[0]);
+
+static const QuantizeKernel *
+best_kernel()
+{
+    for (int i = 0; i < nkernels; i++) {
+        if (kernels[i].supported())
+            return &kernels[i];
+    }
+    return &kernels[nkernels - 1];
+}
+
+// Set from the main thread while encoders on other threads read it.
+static struct KernelSetting {
+    uv_mutex_t mutex;
+    const QuantizeKernel *kernel;
+
+    KernelSetting() : kernel(best_kernel()) { uv_mutex_init(&mutex); }
+} setting;
+
+static const QuantizeKernel *
+current_kernel()
+{
+    uv_mutex_lock(&setting.mutex);
+    const QuantizeKernel *ret = setting.kernel;
+    uv_mutex_unlock(&setting.mutex);
+    return ret;
+}
+
+static void
+use_kernel(const QuantizeKernel *k)
+{
+    uv_mutex_lock(&setting.mutex);
+    setting.kernel = k;
+    uv_mutex_unlock(&setting.mutex);
+}
+
+bool
+set_quantize_kernel(const char *name)
+{
+    if (str_eq(name, "auto")) {
+        use_kernel(best_kernel());
+        return true;
+    }
+    for (int i = 0; i < nkernels; i++) {
+        if (str_eq(name, kernels[i].name) && kernels[i].supported()) {
+            use_kernel(&kernels[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *
+get_quantize_kernel()
+{
+    return current_kernel()->name;
+}
 
 int
-web_safe_quantize(int width, int height,
-    GifByteType *r, GifByteType *g, GifByteType *b,
-    GifByteType *out)
+web_safe_quantize(int width, int height, const unsigned char *data,
+    buffer_type buf_type, GifByteType *out)
 {
     assert(width);
     assert(height);
-    assert(r);
-    assert(g);
-    assert(b);
+    assert(data);
     assert(out);
 
-    // naive quantization
+    current_kernel()->func(data, width*height, buf_type, out);
 
-    typedef std::map<int, char> IdxCache;
-    IdxCache cache;
+    return GIF_OK;
+}
+
+static int quantize_threads = 1;
+
+bool
+set_quantize_threads(int n)
+{
+    if (n < 1 || n > MAX_QUANTIZE_THREADS)
+        return false;
+    quantize_threads = n;
+    return true;
+}
+
+int
+get_quantize_threads()
+{
+    return quantize_threads;
+}
+
+// About 128K of RGBA input per band, so a band stays in L2 while it is
+// quantized and its indices are still cached when LZW reads them.
+#define BAND_PIXELS 32768
+
+struct BandJob {
+    quantize_kernel func;
+    const unsigned char *data;
+    buffer_type buf_type;
+    GifByteType *out;
+    int width, height, band_rows, nbands;
+    band_consumer consume;
+    void *arg;
+
+    uv_mutex_t mutex;
+    uv_cond_t done_cond;
+    int next_band; // first band nobody has taken yet
+    char *done;
+};
+
+static void
+quantize_band(BandJob *job, int band)
+{
+    int top = band*job->band_rows;
+    int rows = job->band_rows < job->height - top ? job->band_rows : job->height - top;
+    job->func(job->data + (size_t)top*job->width*bytes_per_pixel(job->buf_type),
+        rows*job->width, job->buf_type, job->out + (size_t)top*job->width);
+}
+
+// Takes the next unclaimed band, or returns -1 if there are none left.
+static int
+claim_band(BandJob *job)
+{
+    uv_mutex_lock(&job->mutex);
+    int band = job->next_band < job->nbands ? job->next_band++ : -1;
+    uv_mutex_unlock(&job->mutex);
+    return band;
+}
+
+static void
+finish_band(BandJob *job, int band)
+{
+    uv_mutex_lock(&job->mutex);
+    job->done[band] = 1;
+    uv_cond_signal(&job->done_cond);
+    uv_mutex_unlock(&job->mutex);
+}
+
+static void
+band_thread(void *arg, int i)
+{
+    BandJob *job = (BandJob *)arg;
 
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            IdxCache::iterator idx = cache.find(*r<<16 | *g<<8 | *b);
-            if (idx != cache.end()) {
-                *out++ = idx->second;
-                r++; g++; b++;
-                continue;
-            }
-            *out = find_closest_color(*r, *g, *b); // hidden for 255..0 loop!
-            cache[*r<<16 | *g<<8 | *b] = *out;
-            out++; r++; g++; b++;
+    if (i > 0 || !job->consume) {
+        int band;
+        while ((band = claim_band(job)) >= 0) {
+            quantize_band(job, band);
+            finish_band(job, band);
         }
+        return;
     }
 
-    return GIF_OK;
+    // The calling thread feeds the consumer, and quantizes bands itself
+    // whenever the next one in order isn't ready yet.
+    for (int consumed = 0; consumed < job->nbands; ) {
+        uv_mutex_lock(&job->mutex);
+        bool ready = job->done[consumed];
+        int band = -1;
+        if (!ready && job->next_band < job->nbands)
+            band = job->next_band++;
+        else if (!ready) {
+            while (!job->done[consumed])
+                uv_cond_wait(&job->done_cond, &job->mutex);
+            ready = true;
+        }
+        uv_mutex_unlock(&job->mutex);
+
+        if (ready) {
+            int top = consumed*job->band_rows;
+            int rows = job->band_rows < job->height - top ? job->band_rows : job->height - top;
+            job->consume(job->arg, job->out + (size_t)top*job->width, rows*job->width);
+            consumed++;
+        }
+        else {
+            quantize_band(job, band);
+            finish_band(job, band);
+        }
+    }
+}
+
+void
+web_safe_quantize_bands(int width, int height, const unsigned char *data,
+    buffer_type buf_type, GifByteType *out, band_consumer consume, void *arg)
+{
+    if (width <= 0 || height <= 0)
+        return; // no pixels, and no rows to split
+
+    BandJob job;
+    job.func = current_kernel()->func; // the same for every band
+    job.band_rows = BAND_PIXELS/width > 1 ? BAND_PIXELS/width : 1;
+    job.nbands = (height + job.band_rows - 1)/job.band_rows;
+
+    // bands go to the threads run_parallel keeps, more than the cores
+    // wouldn't get any further
+    int nthreads = std::min(std::min(quantize_threads, job.nbands), parallel_cores());
+    if (nthreads <= 1 || !(job.done = (char *)calloc(job.nbands, 1))) {
+        web_safe_quantize(width, height, data, buf_type, out);
+        if (consume)
+            consume(arg, out, width*height);
+        return;
+    }
+
+    job.data = data;
+    job.buf_type = buf_type;
+    job.out = out;
+    job.width = width;
+    job.height = height;
+    job.consume = consume;
+    job.arg = arg;
+    job.next_band = 0;
+    uv_mutex_init(&job.mutex);
+    uv_cond_init(&job.done_cond);
+
+    run_parallel(nthreads, band_thread, &job);
+
+    uv_cond_destroy(&job.done_cond);
+    uv_mutex_destroy(&job.mutex);
+    free(job.done);
+}
+
+// Open addressing table of colors seen so far, keys are 0xRRGGBB + 1 so
+// that zero marks a free slot. 1024 slots keep the load under 1/4.
+#define EXACT_SLOTS 1024
+
+static inline unsigned int
+exact_slot(unsigned int key)
+{
+    return (key*2654435761u) >> 22;
+}
+
+int
+exact_quantize(const unsigned char *data, int n, buffer_type buf_type,
+    GifColorType *colors, GifByteType *out)
+{
+    unsigned int keys[EXACT_SLOTS];
+    GifByteType idxs[EXACT_SLOTS];
+    memset(keys, 0, sizeof(keys));
+
+    int bpp = bytes_per_pixel(buf_type);
+    int ri = 0, bi = 2;
+    if (buf_type == BUF_BGR || buf_type == BUF_BGRA) {
+        ri = 2;
+        bi = 0;
+    }
+
+    int ncolors = 0;
+    unsigned int last_key = 0;
+    GifByteType last_idx = 0;
+    for (int i = 0; i < n; i++, data += bpp) {
+        unsigned int key = (data[ri] << 16 | data[1] << 8 | data[bi]) + 1;
+        if (key == last_key) { // runs are common in the images this is for
+            *out++ = last_idx;
+            continue;
+        }
+        unsigned int slot = exact_slot(key);
+        while (keys[slot] && keys[slot] != key)
+            slot = (slot + 1) & (EXACT_SLOTS - 1);
+        if (!keys[slot]) {
+            if (ncolors == 256)
+                return 0;
+            keys[slot] = key;
+            idxs[slot] = ncolors;
+            colors[ncolors].Red = data[ri];
+            colors[ncolors].Green = data[1];
+            colors[ncolors].Blue = data[bi];
+            ncolors++;
+        }
+        last_key = key;
+        last_idx = idxs[slot];
+        *out++ = last_idx;
+    }
+
+    return ncolors;
+}
+
+int
+color_table_size(int ncolors)
+{
+    int size = 2;
+    while (size < ncolors)
+        size <<= 1;
+    return size;
+}
+
+int
+compact_palette(GifByteType *buf, int n, GifColorType *colors, int ncolors,
+    int &transparent_idx)
+{
+    bool used[256] = { false };
+    for (int i = 0; i < n; i++)
+        used[buf[i]] = true;
+
+    GifByteType remap[256];
+    int nused = 0;
+    for (int i = 0; i < ncolors; i++) {
+        if (used[i])
+            remap[i] = nused++;
+    }
+    if (color_table_size(nused) >= color_table_size(ncolors))
+        return 0;
+
+    for (int i = 0; i < ncolors; i++) {
+        if (used[i])
+            colors[remap[i]] = colors[i];
+    }
+    for (int i = 0; i < n; i++)
+        buf[i] = remap[buf[i]];
+
+    if (transparent_idx >= 0)
+        transparent_idx = used[transparent_idx] ? remap[transparent_idx] : -1;
+
+    return nused;
 }
@@ -3,9 +3,60 @@
 
 #include <gif_lib.h>
 
-int web_safe_quantize(int width, int height,
-    GifByteType *r, GifByteType *g, GifByteType *b,
-    GifByteType *out);
+#include "common.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define QUANTIZE_X86
+#endif
+
+#define MAX_QUANTIZE_THREADS 64
+
+// Maps n interleaved pixels of buf_type straight to web safe palette indices.
+typedef void (*quantize_kernel)(const unsigned char *data, int n,
+    buffer_type buf_type, GifByteType *out);
+
+int web_safe_quantize(int width, int height, const unsigned char *data,
+    buffer_type buf_type, GifByteType *out);
+
+typedef void (*band_consumer)(void *arg, const GifByteType *pixels, int n);
+
+// web_safe_quantize split into bands of rows that get_quantize_threads()
+// threads, no more than there are cores, work through. They are the
+// threads run_parallel keeps from one frame to the next. With consume
+// given, the calling thread hands it every band, in order, as soon as it
+// is done, while later bands are still being quantized. The output is the
+// same as web_safe_quantize's.
+void web_safe_quantize_bands(int width, int height, const unsigned char *data,
+    buffer_type buf_type, GifByteType *out, band_consumer consume, void *arg);
+
+// Maps the pixels to their own colors, in order of first appearance, as
+// long as there are no more than 256 of them. Returns the number of colors
+// or 0 if there are more.
+int exact_quantize(const unsigned char *data, int n, buffer_type buf_type,
+    GifColorType *colors, GifByteType *out);
+
+// Smallest power of two color table, at least 2 entries, that fits ncolors.
+int color_table_size(int ncolors);
+
+// Renumbers the indices in buf so that only the palette entries in use are
+// left, packed at the front of colors, if that allows a smaller color table.
+// Returns the new number of colors or 0 if nothing was changed.
+int compact_palette(GifByteType *buf, int n, GifColorType *colors, int ncolors,
+    int &transparent_idx);
+
+bool set_quantize_kernel(const char *name);
+const char *get_quantize_kernel();
+
+// Threads web_safe_quantize_bands uses, 1 (no extra threads) by default.
+bool set_quantize_threads(int n);
+int get_quantize_threads();
+
+#ifdef QUANTIZE_X86
+void web_safe_quantize_sse2(const unsigned char *data, int n,
+    buffer_type buf_type, GifByteType *out);
+void web_safe_quantize_avx2(const unsigned char *data, int n,
+    buffer_type buf_type, GifByteType *out);
+#endif
 
 #endif
 
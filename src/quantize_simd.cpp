@@ -0,0 +1,200 @@
+#include "common.h"
+#include "quantize.h"
+#include "palette.h"
+
+#ifdef QUANTIZE_X86
+
+#include <immintrin.h>
+
+// Vector versions of web_safe_color_index. Every lane gets the nearest
+// entry of the 6x6x6 cube; lanes where a gray or the transparent color
+// could be as close are redone with web_safe_color_index. Those can only
+// win when (spread - 1)^2 <= 2*cube_dist, where spread is max(r,g,b) -
+// min(r,g,b), so most pixels of colorful images never leave the vector
+// path.
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+static inline int
+pixel_index(const unsigned char *p, bool bgr)
+{
+    return bgr ? web_safe_color_index(p[2], p[1], p[0]) :
+        web_safe_color_index(p[0], p[1], p[2]);
+}
+
+static void
+quantize_tail(const unsigned char *data, int n, int bpp, bool bgr, GifByteType *out)
+{
+    for (int i = 0; i < n; i++, data += bpp)
+        *out++ = pixel_index(data, bgr);
+}
+
+TARGET_SSE2 static inline __m128i
+cube_level_sse2(__m128i c, __m128i &dist)
+{
+    // (c + 25)/51 for 0 <= c <= 255
+    __m128i level = _mm_mulhi_epu16(_mm_add_epi16(c, _mm_set1_epi16(25)), _mm_set1_epi16(1286));
+    __m128i d = _mm_sub_epi16(c, _mm_mullo_epi16(level, _mm_set1_epi16(51)));
+    dist = _mm_add_epi16(dist, _mm_mullo_epi16(d, d));
+    return level;
+}
+
+// 8 pixels, channels in 16 bit lanes
+TARGET_SSE2 static inline void
+quantize8_sse2(__m128i r, __m128i g, __m128i b,
+    const unsigned char *data, int bpp, bool bgr, GifByteType *out)
+{
+    __m128i dist = _mm_setzero_si128();
+    __m128i lr = cube_level_sse2(r, dist);
+    __m128i lg = cube_level_sse2(g, dist);
+    __m128i lb = cube_level_sse2(b, dist);
+    __m128i idx = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(lr, _mm_set1_epi16(36)),
+        _mm_mullo_epi16(lg, _mm_set1_epi16(6))), lb);
+    _mm_storel_epi64((__m128i *)out, _mm_packus_epi16(idx, idx));
+
+    __m128i spread = _mm_sub_epi16(_mm_max_epi16(_mm_max_epi16(r, g), b),
+        _mm_min_epi16(_mm_min_epi16(r, g), b));
+    spread = _mm_min_epi16(_mm_subs_epu16(spread, _mm_set1_epi16(1)), _mm_set1_epi16(64));
+    __m128i cube_only = _mm_cmpgt_epi16(_mm_mullo_epi16(spread, spread), _mm_slli_epi16(dist, 1));
+
+    int fixup = ~_mm_movemask_epi8(cube_only) & 0xffff;
+    while (fixup) {
+        int lane = __builtin_ctz(fixup)/2;
+        out[lane] = pixel_index(data + lane*bpp, bgr);
+        fixup &= ~(3 << lane*2);
+    }
+}
+
+TARGET_SSE2 void
+web_safe_quantize_sse2(const unsigned char *data, int n,
+    buffer_type buf_type, GifByteType *out)
+{
+    int bpp = bytes_per_pixel(buf_type);
+    bool bgr = buf_type == BUF_BGR || buf_type == BUF_BGRA;
+    int i = 0;
+
+    if (bpp == 4) {
+        const __m128i mask = _mm_set1_epi32(0xff);
+        for (; i + 8 <= n; i += 8, data += 32, out += 8) {
+            __m128i p0 = _mm_loadu_si128((const __m128i *)data);
+            __m128i p1 = _mm_loadu_si128((const __m128i *)(data + 16));
+            __m128i c0 = _mm_packs_epi32(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+            __m128i c1 = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), mask),
+                _mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+            __m128i c2 = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask),
+                _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+            if (bgr)
+                quantize8_sse2(c2, c1, c0, data, bpp, bgr, out);
+            else
+                quantize8_sse2(c0, c1, c2, data, bpp, bgr, out);
+        }
+    }
+    else {
+        unsigned short c[3][8];
+        for (; i + 8 <= n; i += 8, data += 24, out += 8) {
+            for (int j = 0; j < 8; j++) {
+                c[0][j] = data[j*3];
+                c[1][j] = data[j*3 + 1];
+                c[2][j] = data[j*3 + 2];
+            }
+            __m128i c0 = _mm_loadu_si128((const __m128i *)c[0]);
+            __m128i c1 = _mm_loadu_si128((const __m128i *)c[1]);
+            __m128i c2 = _mm_loadu_si128((const __m128i *)c[2]);
+            if (bgr)
+                quantize8_sse2(c2, c1, c0, data, bpp, bgr, out);
+            else
+                quantize8_sse2(c0, c1, c2, data, bpp, bgr, out);
+        }
+    }
+
+    quantize_tail(data, n - i, bpp, bgr, out);
+}
+
+TARGET_AVX2 static inline __m256i
+cube_level_avx2(__m256i c, __m256i &dist)
+{
+    __m256i level = _mm256_mulhi_epu16(_mm256_add_epi16(c, _mm256_set1_epi16(25)), _mm256_set1_epi16(1286));
+    __m256i d = _mm256_sub_epi16(c, _mm256_mullo_epi16(level, _mm256_set1_epi16(51)));
+    dist = _mm256_add_epi16(dist, _mm256_mullo_epi16(d, d));
+    return level;
+}
+
+// 16 pixels, channels in 16 bit lanes
+TARGET_AVX2 static inline void
+quantize16_avx2(__m256i r, __m256i g, __m256i b,
+    const unsigned char *data, int bpp, bool bgr, GifByteType *out)
+{
+    __m256i dist = _mm256_setzero_si256();
+    __m256i lr = cube_level_avx2(r, dist);
+    __m256i lg = cube_level_avx2(g, dist);
+    __m256i lb = cube_level_avx2(b, dist);
+    __m256i idx = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(lr, _mm256_set1_epi16(36)),
+        _mm256_mullo_epi16(lg, _mm256_set1_epi16(6))), lb);
+    idx = _mm256_permute4x64_epi64(_mm256_packus_epi16(idx, idx), 0x08);
+    _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(idx));
+
+    __m256i spread = _mm256_sub_epi16(_mm256_max_epi16(_mm256_max_epi16(r, g), b),
+        _mm256_min_epi16(_mm256_min_epi16(r, g), b));
+    spread = _mm256_min_epi16(_mm256_subs_epu16(spread, _mm256_set1_epi16(1)), _mm256_set1_epi16(64));
+    __m256i cube_only = _mm256_cmpgt_epi16(_mm256_mullo_epi16(spread, spread), _mm256_slli_epi16(dist, 1));
+
+    unsigned int fixup = ~(unsigned int)_mm256_movemask_epi8(cube_only);
+    while (fixup) {
+        int lane = __builtin_ctz(fixup)/2;
+        out[lane] = pixel_index(data + lane*bpp, bgr);
+        fixup &= ~(3u << lane*2);
+    }
+}
+
+TARGET_AVX2 void
+web_safe_quantize_avx2(const unsigned char *data, int n,
+    buffer_type buf_type, GifByteType *out)
+{
+    int bpp = bytes_per_pixel(buf_type);
+    bool bgr = buf_type == BUF_BGR || buf_type == BUF_BGRA;
+    int i = 0;
+
+    if (bpp == 4) {
+        const __m256i mask = _mm256_set1_epi32(0xff);
+        for (; i + 16 <= n; i += 16, data += 64, out += 16) {
+            __m256i p0 = _mm256_loadu_si256((const __m256i *)data);
+            __m256i p1 = _mm256_loadu_si256((const __m256i *)(data + 32));
+            // packs works within 128 bit halves, the permute restores pixel order
+            __m256i c0 = _mm256_permute4x64_epi64(_mm256_packs_epi32(
+                _mm256_and_si256(p0, mask), _mm256_and_si256(p1, mask)), 0xd8);
+            __m256i c1 = _mm256_permute4x64_epi64(_mm256_packs_epi32(
+                _mm256_and_si256(_mm256_srli_epi32(p0, 8), mask),
+                _mm256_and_si256(_mm256_srli_epi32(p1, 8), mask)), 0xd8);
+            __m256i c2 = _mm256_permute4x64_epi64(_mm256_packs_epi32(
+                _mm256_and_si256(_mm256_srli_epi32(p0, 16), mask),
+                _mm256_and_si256(_mm256_srli_epi32(p1, 16), mask)), 0xd8);
+            if (bgr)
+                quantize16_avx2(c2, c1, c0, data, bpp, bgr, out);
+            else
+                quantize16_avx2(c0, c1, c2, data, bpp, bgr, out);
+        }
+    }
+    else {
+        unsigned short c[3][16];
+        for (; i + 16 <= n; i += 16, data += 48, out += 16) {
+            for (int j = 0; j < 16; j++) {
+                c[0][j] = data[j*3];
+                c[1][j] = data[j*3 + 1];
+                c[2][j] = data[j*3 + 2];
+            }
+            __m256i c0 = _mm256_loadu_si256((const __m256i *)c[0]);
+            __m256i c1 = _mm256_loadu_si256((const __m256i *)c[1]);
+            __m256i c2 = _mm256_loadu_si256((const __m256i *)c[2]);
+            if (bgr)
+                quantize16_avx2(c2, c1, c0, data, bpp, bgr, out);
+            else
+                quantize16_avx2(c0, c1, c2, data, bpp, bgr, out);
+        }
+    }
+
+    quantize_tail(data, n - i, bpp, bgr, out);
+}
+
+#endif
+
@@ -0,0 +1,42 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var temp = require('temp');
+var assert = require('assert');
+
+// Once encode is called the gif is closed, pushing more fragments or frames
+// throws, both while the frames are still being encoded and after.
+
+var width = 32, height = 32;
+var frame = new Buffer(width*height*3);
+for (var i = 0; i < frame.length; i++)
+    frame[i] = i*11;
+
+var animatedGif = new GifLib.AsyncAnimatedGif(width, height);
+animatedGif.setOutputFile('animated-async-closed.gif');
+animatedGif.setTmpDir(temp.mkdirSync());
+animatedGif.push(frame, 0, 0, width, height);
+animatedGif.endPush();
+
+function assertClosed() {
+    assert.throws(function () {
+        animatedGif.push(frame, 0, 0, width, height);
+    }, /once encode was called/);
+    assert.throws(function () {
+        animatedGif.endPush();
+    }, /once encode was called/);
+    assert.throws(function () {
+        animatedGif.encode(function () {});
+    }, /Already encoding/);
+}
+
+var called = false;
+animatedGif.encode(function (status, error) {
+    if (!status) throw error;
+    assertClosed();
+    called = true;
+});
+assertClosed();
+
+process.on('exit', function () {
+    assert.ok(called, 'encode never finished');
+});
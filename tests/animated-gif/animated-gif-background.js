@@ -0,0 +1,61 @@
+var GifLib = require('../../build/Release/gif');
+var assert = require('assert');
+var frames = require('./frames');
+
+// Frames encoded on the background thread must come out exactly as when
+// endPush encodes them itself. With a full queue endPush doesn't block but
+// returns false, and the frame is closed again a little later.
+
+var sync = new GifLib.AnimatedGif(720,400);
+frames.push(sync);
+var expected = sync.getGif();
+var expectedStats = sync.getStats();
+
+var recording = frames.load();
+var animatedGif = new GifLib.AnimatedGif(720,400);
+animatedGif.setBackgroundEncoding(1);
+var retries = 0;
+
+function pushFrame(i) {
+    if (i == recording.length)
+        return done();
+    recording[i].forEach(function (f) {
+        animatedGif.push(f.rgb, f.x, f.y, f.w, f.h);
+    });
+    endFrame(i);
+}
+
+function endFrame(i) {
+    if (!animatedGif.endPush()) {
+        retries++;
+        return setTimeout(function () { endFrame(i); }, 1);
+    }
+    if (i == 0) {
+        // the encoder is the thread's now
+        assert.throws(function () { animatedGif.setPalette('adaptive'); });
+        assert.throws(function () { animatedGif.setDeltaTolerance(4); });
+        assert.throws(function () { animatedGif.setDuplicateThreshold(0); });
+        assert.throws(function () { animatedGif.setPersistentCanvas(true); });
+        assert.ok(animatedGif.getStats().frames <= 1);
+    }
+    pushFrame(i + 1);
+}
+
+function done() {
+    animatedGif.getGif(function (gif, error) {
+        assert.ifError(error);
+        assert.equal(animatedGif.getGif().toString('hex'), gif.toString('hex'));
+        console.log(gif.length + ' bytes, endPush retried ' + retries + ' times');
+        assert.equal(gif.toString('hex'), expected.toString('hex'),
+            'background output differs');
+        var stats = animatedGif.getStats();
+        assert.equal(stats.frames, expectedStats.frames);
+        assert.equal(stats.croppedFrames, expectedStats.croppedFrames);
+    });
+    // while the thread is still finishing the output isn't there to take
+    assert.throws(function () { animatedGif.end(); }, /Already finishing/);
+    assert.throws(function () { animatedGif.getGif(); }, /Already finishing/);
+    assert.throws(function () { animatedGif.end(function () {}); }, /Already finishing/);
+}
+
+pushFrame(0);
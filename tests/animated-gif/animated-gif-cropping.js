@@ -0,0 +1,46 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var assert = require('assert');
+var reader = require('../gif-reader');
+
+// Frames that only change a small area are written as sub-images of that
+// area. Once the area gets over three quarters of the screen, the whole
+// frame is written again.
+
+var width = 64, height = 64;
+
+function fragment(w, h, shade) {
+    var buf = new Buffer(w*h*3);
+    for (var i = 0; i < w*h; i++) {
+        buf[i*3] = shade;
+        buf[i*3 + 1] = (i*9) & 0xff;
+        buf[i*3 + 2] = 0x33;
+    }
+    return buf;
+}
+
+var animatedGif = new GifLib.AnimatedGif(width, height);
+animatedGif.push(fragment(width, height, 0), 0, 0, width, height);
+animatedGif.endPush();
+for (var k = 0; k < 3; k++) {
+    animatedGif.push(fragment(8, 8, 0x40*k), 10 + k*4, 20, 8, 8);
+    animatedGif.endPush();
+}
+animatedGif.push(fragment(60, 60, 0xcc), 2, 2, 60, 60);
+animatedGif.endPush();
+
+var gif = reader.decode(animatedGif.getGif());
+var stats = animatedGif.getStats();
+assert.equal(stats.frames, 5);
+assert.equal(stats.croppedFrames, 3);
+
+var rects = gif.images.map(function (image) {
+    return [image.x, image.y, image.width, image.height].join(',');
+});
+assert.deepEqual(rects, [
+    '0,0,64,64',
+    '10,20,8,8',
+    '14,20,8,8',
+    '18,20,8,8',
+    '0,0,64,64'
+]);
@@ -0,0 +1,24 @@
+var GifLib = require('../../build/Release/gif');
+var assert = require('assert');
+var frames = require('./frames');
+
+// Pixels within the delta tolerance of what is already on screen are left
+// transparent, which makes the recording smaller than without a tolerance.
+
+function encode(tolerance) {
+    var animatedGif = new GifLib.AnimatedGif(720,400);
+    animatedGif.setDeltaTolerance(tolerance);
+    frames.push(animatedGif);
+    return { gif: animatedGif.getGif(), stats: animatedGif.getStats() };
+}
+
+var off = encode(-1);
+var delta = encode(4);
+console.log(delta.stats.frames + ' frames, ' + delta.stats.unchangedPixels +
+    ' unchanged pixels left transparent, ' + delta.gif.length + ' bytes instead of ' +
+    off.gif.length);
+
+assert.equal(off.stats.unchangedPixels, 0);
+assert.ok(delta.stats.unchangedPixels > 0, 'no pixels left transparent');
+assert.equal(delta.stats.frames, off.stats.frames);
+assert.ok(delta.gif.length < off.gif.length, 'delta output is no smaller');
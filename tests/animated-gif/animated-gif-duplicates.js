@@ -0,0 +1,64 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var assert = require('assert');
+var reader = require('../gif-reader');
+
+// With a duplicate threshold, repeated frames aren't written and their
+// delays go to the frame they repeat. Turned on between frames, the threshold
+// can't add to a frame that is already written, the animation keeps its
+// length either way.
+
+var width = 32, height = 32;
+
+function frame(shade) {
+    var buf = new Buffer(width*height*3);
+    for (var i = 0; i < width*height; i++) {
+        buf[i*3] = shade;
+        buf[i*3 + 1] = (i*7) & 0xff;
+        buf[i*3 + 2] = 0x66;
+    }
+    return buf;
+}
+
+function push(animatedGif, buf, delay) {
+    animatedGif.push(buf, 0, 0, width, height);
+    animatedGif.endPush(delay);
+}
+
+function delays(gif) {
+    return gif.images.map(function (image) { return image.delay; });
+}
+
+var a = frame(0x10), b = frame(0x90);
+
+var animatedGif = new GifLib.AnimatedGif(width, height);
+animatedGif.setDuplicateThreshold(0);
+push(animatedGif, a, 10);
+push(animatedGif, a, 20);
+push(animatedGif, a, 30);
+push(animatedGif, b, 5);
+push(animatedGif, b, 7);
+animatedGif.end();
+
+var gif = reader.decode(animatedGif.getGif());
+var stats = animatedGif.getStats();
+assert.equal(stats.elidedFrames, 3);
+assert.equal(gif.images.length, 2);
+assert.deepEqual(delays(gif), [60, 12]);
+
+// the first frame is written as soon as the second comes without a
+// threshold, the repeat after it has to be a frame of its own
+animatedGif = new GifLib.AnimatedGif(width, height);
+animatedGif.setDuplicateThreshold(0);
+push(animatedGif, a, 10);
+animatedGif.setDuplicateThreshold(-1);
+push(animatedGif, a, 20);
+animatedGif.setDuplicateThreshold(0);
+push(animatedGif, a, 30);
+push(animatedGif, a, 40);
+animatedGif.end();
+
+gif = reader.decode(animatedGif.getGif());
+stats = animatedGif.getStats();
+assert.equal(stats.elidedFrames, 1);
+assert.deepEqual(delays(gif), [10, 20, 70]);
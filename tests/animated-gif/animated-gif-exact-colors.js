@@ -0,0 +1,48 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var assert = require('assert');
+var reader = require('../gif-reader');
+
+// With the default web safe palette, frames of a few flat colors keep them
+// exactly, in local color tables. Frames of more colors still use the web
+// safe global table.
+
+var width = 32, height = 32;
+var flat = [[0x12, 0x34, 0x56], [0xfa, 0x80, 0x72], [0x2e, 0x8b, 0x57]];
+
+function stripes(colors) {
+    var buf = new Buffer(width*height*3);
+    for (var i = 0; i < width*height; i++) {
+        var c = colors[Math.floor(i/width)%colors.length];
+        buf[i*3] = c[0];
+        buf[i*3 + 1] = c[1];
+        buf[i*3 + 2] = c[2];
+    }
+    return buf;
+}
+
+var noise = new Buffer(width*height*3);
+var seed = 1;
+for (var i = 0; i < noise.length; i++) {
+    seed = (seed*69069 + 1)%4294967296;
+    noise[i] = seed >>> 24;
+}
+
+var animatedGif = new GifLib.AnimatedGif(width, height);
+[stripes(flat), stripes(flat.slice().reverse()), noise].forEach(function (frame) {
+    animatedGif.push(frame, 0, 0, width, height);
+    animatedGif.endPush();
+});
+var gif = reader.decode(animatedGif.getGif());
+assert.equal(animatedGif.getStats().localColorTables, 2);
+assert.ok(gif.images[0].colors && gif.images[1].colors, 'flat frames without a table of their own');
+assert.ok(!gif.images[2].colors, 'noise frame with a table of its own');
+
+[flat, flat.slice().reverse()].forEach(function (colors, f) {
+    var screen = reader.render(gif, f + 1);
+    for (var i = 0; i < width*height; i++) {
+        var c = colors[Math.floor(i/width)%colors.length];
+        assert.deepEqual([screen[i*4], screen[i*4 + 1], screen[i*4 + 2]], c,
+            'frame ' + f + ' pixel ' + i);
+    }
+});
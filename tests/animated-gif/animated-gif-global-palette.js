@@ -0,0 +1,48 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var assert = require('assert');
+var reader = require('../gif-reader');
+
+var width = 32, height = 32;
+
+// 64 shades of gray, shifted along by shift pixels.
+function grays(shift) {
+    var buf = new Buffer(width*height*3);
+    for (var i = 0; i < width*height; i++)
+        buf[i*3] = buf[i*3 + 1] = buf[i*3 + 2] = ((i + shift)%64)*4;
+    return buf;
+}
+
+// 32 oranges, none of them anywhere near a gray.
+function oranges() {
+    var buf = new Buffer(width*height*3);
+    for (var i = 0; i < width*height; i++) {
+        buf[i*3] = 0xff;
+        buf[i*3 + 1] = (i%width)*8;
+        buf[i*3 + 2] = 0;
+    }
+    return buf;
+}
+
+var animatedGif = new GifLib.AnimatedGif(width, height);
+animatedGif.setPalette('global', 2);
+
+// The first two frames are the sample the global palette is built from, the
+// third one maps to it exactly and the last one needs a table of its own.
+[grays(0), grays(7), grays(0), oranges()].forEach(function (frame) {
+    animatedGif.push(frame, 0, 0, width, height);
+    animatedGif.endPush(10);
+});
+
+var gif = reader.decode(animatedGif.getGif());
+
+var stats = animatedGif.getStats();
+assert.equal(stats.frames, 4);
+assert.equal(stats.localColorTables, 1);
+
+assert.equal(gif.images.length, 4);
+assert.ok(gif.colors);
+assert.equal(gif.images[0].colors, null);
+assert.equal(gif.images[1].colors, null);
+assert.equal(gif.images[2].colors, null);
+assert.equal(gif.images[3].colors.length, 32);
@@ -0,0 +1,28 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var assert = require('assert');
+var reader = require('../gif-reader');
+
+// getGif hands over the encoder's output as a Buffer once and keeps
+// returning that same Buffer, however it is asked for.
+
+var width = 16, height = 16;
+var animatedGif = new GifLib.AnimatedGif(width, height);
+var frame = new Buffer(width*height*3);
+for (var i = 0; i < frame.length; i++)
+    frame[i] = i*5;
+animatedGif.push(frame, 0, 0, width, height);
+animatedGif.endPush();
+
+var gif = animatedGif.getGif();
+assert.ok(Buffer.isBuffer(gif));
+assert.equal(reader.decode(gif).images.length, 1);
+
+assert.strictEqual(animatedGif.getGif(), gif);
+var called = false;
+animatedGif.getGif(function (again, error) {
+    assert.ifError(error);
+    assert.strictEqual(again, gif);
+    called = true;
+});
+assert.ok(called, 'callback not called without background encoding');
@@ -0,0 +1,55 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var assert = require('assert');
+
+// The output callback gets Buffers of at least chunkSize bytes, over by no
+// more than the one write that filled them (a color table at most), and
+// whatever is left at the end of every frame and at end(). Together they
+// are the same file getGif returns.
+
+var width = 64, height = 64, chunkSize = 1024;
+
+// noise doesn't compress, every frame is a few chunks
+var frames = [];
+var seed = 1;
+for (var f = 0; f < 10; f++) {
+    var frame = new Buffer(width*height*3);
+    for (var i = 0; i < frame.length; i++) {
+        seed = (seed*69069 + 1)%4294967296;
+        frame[i] = seed >>> 24;
+    }
+    frames.push(frame);
+}
+
+var inMemory = new GifLib.AnimatedGif(width, height);
+frames.forEach(function (frame) {
+    inMemory.push(frame, 0, 0, width, height);
+    inMemory.endPush();
+});
+var expected = inMemory.getGif();
+
+var chunks = [];
+var animatedGif = new GifLib.AnimatedGif(width, height);
+animatedGif.setOutputCallback(function (chunk) {
+    chunks.push(chunk);
+}, chunkSize);
+
+frames.forEach(function (frame) {
+    var first = chunks.length;
+    animatedGif.push(frame, 0, 0, width, height);
+    animatedGif.endPush();
+
+    var delivered = chunks.slice(first);
+    assert.ok(delivered.length > 1, 'frame delivered in ' + delivered.length + ' chunks');
+    delivered.forEach(function (chunk, i) {
+        if (i < delivered.length - 1)
+            assert.ok(chunk.length >= chunkSize, 'short chunk of ' + chunk.length + ' bytes');
+        assert.ok(chunk.length > 0 && chunk.length < chunkSize + 768,
+            'chunk of ' + chunk.length + ' bytes');
+    });
+});
+var beforeEnd = chunks.length;
+animatedGif.end();
+assert.equal(chunks.length, beforeEnd + 1, 'the trailer comes in a chunk of its own');
+
+assert.equal(Buffer.concat(chunks).toString('hex'), expected.toString('hex'));
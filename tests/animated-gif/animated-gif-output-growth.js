@@ -0,0 +1,35 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var assert = require('assert');
+
+// The in-memory output at least doubles whenever it runs out of room, so a
+// long animation takes a logarithmic number of reallocations, and all of
+// them together copy about as much as the output ends up holding.
+
+var width = 64, height = 64;
+var animatedGif = new GifLib.AnimatedGif(width, height);
+
+// noise doesn't compress, every frame adds a few kilobytes
+var frame = new Buffer(width*height*3);
+var seed = 1;
+for (var f = 0; f < 200; f++) {
+    for (var i = 0; i < frame.length; i++) {
+        seed = (seed*69069 + 1)%4294967296;
+        frame[i] = seed >>> 24;
+    }
+    animatedGif.push(frame, 0, 0, width, height);
+    animatedGif.endPush();
+}
+
+var gif = animatedGif.getGif();
+var stats = animatedGif.getStats();
+console.log(gif.length + ' bytes, ' + stats.outputAllocs + ' allocations, ' +
+    stats.outputBytesCopied + ' bytes copied');
+
+// growth starts at 10K at the latest, after the first estimate
+var doublings = Math.ceil(Math.log(gif.length/(10*1024))/Math.LN2);
+assert.ok(stats.outputAllocs > 1, 'output never grew');
+assert.ok(stats.outputAllocs <= 2 + doublings,
+    stats.outputAllocs + ' allocations for ' + gif.length + ' bytes');
+assert.ok(stats.outputBytesCopied <= 2*gif.length,
+    stats.outputBytesCopied + ' bytes copied for ' + gif.length + ' bytes');
@@ -0,0 +1,29 @@
+var GifLib = require('../../build/Release/gif');
+var fs = require('fs');
+var temp = require('temp');
+var assert = require('assert');
+var frames = require('./frames');
+
+// frames prepared one at a time and four at once must give the same file
+function encode(parallelFrames, outputFile, done) {
+    var animatedGif = new GifLib.AsyncAnimatedGif(720,400);
+    animatedGif.setOutputFile(outputFile);
+    animatedGif.setTmpDir(temp.mkdirSync());
+    animatedGif.setParallelFrames(parallelFrames);
+
+    frames.push(animatedGif);
+
+    animatedGif.encode(function (status, error) {
+        if (!status) throw error;
+        done();
+    });
+}
+
+encode(1, 'animated-serial.gif', function () {
+    encode(4, 'animated-parallel.gif', function () {
+        var serial = fs.readFileSync('animated-serial.gif');
+        var parallel = fs.readFileSync('animated-parallel.gif');
+        assert.equal(serial.toString('base64'), parallel.toString('base64'));
+        console.log('parallel output matches, ' + parallel.length + ' bytes');
+    });
+});
@@ -0,0 +1,55 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var assert = require('assert');
+var reader = require('../gif-reader');
+
+// With a persistent canvas, what isn't pushed for a frame is still the
+// previous frame's. Two fragments in opposite corners of a square get
+// encoded together with the old pixels between them, where a fresh canvas
+// only has transparent ones.
+
+var width = 64, height = 64;
+
+function fill(w, h, color) {
+    var buf = new Buffer(w*h*3);
+    for (var i = 0; i < w*h; i++) {
+        buf[i*3] = color[0];
+        buf[i*3 + 1] = color[1];
+        buf[i*3 + 2] = color[2];
+    }
+    return buf;
+}
+
+function encode(persistent) {
+    var animatedGif = new GifLib.AnimatedGif(width, height);
+    animatedGif.setPersistentCanvas(persistent);
+    animatedGif.push(fill(width, height, [0x33, 0x66, 0x99]), 0, 0, width, height);
+    animatedGif.endPush();
+    animatedGif.push(fill(4, 4, [0xcc, 0, 0]), 0, 0, 4, 4);
+    animatedGif.push(fill(4, 4, [0, 0xcc, 0]), 28, 28, 4, 4);
+    animatedGif.endPush();
+    return reader.decode(animatedGif.getGif());
+}
+
+// the color drawn by image i at x, y of the screen, or null if transparent
+function drawn(gif, i, x, y) {
+    var image = gif.images[i];
+    var idx = image.pixels[(y - image.y)*image.width + x - image.x];
+    return idx == image.transparent ? null : (image.colors || gif.colors)[idx];
+}
+
+var fresh = encode(false);
+var persistent = encode(true);
+
+[fresh, persistent].forEach(function (gif) {
+    assert.equal(gif.images.length, 2);
+    var image = gif.images[1];
+    assert.deepEqual([image.x, image.y, image.width, image.height], [0, 0, 32, 32]);
+    assert.deepEqual(drawn(gif, 1, 1, 1), [0xcc, 0, 0]);
+    assert.deepEqual(drawn(gif, 1, 30, 30), [0, 0xcc, 0]);
+});
+assert.equal(drawn(fresh, 1, 16, 16), null);
+assert.deepEqual(drawn(persistent, 1, 16, 16), [0x33, 0x66, 0x99]);
+
+// either way the screen ends up the same
+assert.equal(reader.render(persistent).toString('hex'), reader.render(fresh).toString('hex'));
@@ -0,0 +1,49 @@
+var GifLib = require('../../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var temp = require('temp');
+var assert = require('assert');
+
+// Spilled fragments go to a spool file that is unlinked once opened, the
+// tmp dir stays empty. Fragments without pixels are left out. encode
+// without a frame reports an error instead of leaving no output file behind
+// without a word.
+
+var width = 64, height = 64;
+var tmpDir = temp.mkdirSync();
+
+var animatedGif = new GifLib.AsyncAnimatedGif(width, height);
+animatedGif.setOutputFile('animated-spool-file.gif');
+animatedGif.setTmpDir(tmpDir);
+animatedGif.setMemoryBudget(0);
+
+var frame = new Buffer(width*height*3);
+for (var f = 0; f < 5; f++) {
+    for (var i = 0; i < frame.length; i++)
+        frame[i] = (i*3 + f*40) & 0xff;
+    animatedGif.push(frame, 0, 0, width, height);
+    // nothing to draw, skipped
+    animatedGif.push(frame, 0, 0, 0, height);
+    animatedGif.push(frame, 0, 0, width, 0);
+    animatedGif.endPush();
+}
+
+animatedGif.encode(function (status, error) {
+    if (!status) throw error;
+    var stats = animatedGif.getSpoolStats();
+    assert.equal(stats.fragments, 5);
+    assert.ok(stats.spilledBytes > 0, 'nothing was spilled');
+    assert.deepEqual(fs.readdirSync(tmpDir), []);
+    assert.ok(fs.statSync('animated-spool-file.gif').size > 0);
+
+    if (fs.existsSync('animated-empty.gif'))
+        fs.unlinkSync('animated-empty.gif');
+    var empty = new GifLib.AsyncAnimatedGif(width, height);
+    empty.setOutputFile('animated-empty.gif');
+    empty.setTmpDir(tmpDir);
+    empty.encode(function (status, error) {
+        assert.equal(status, false);
+        assert.ok(/No frames/.test(error.message), error.message);
+        assert.ok(!fs.existsSync('animated-empty.gif'));
+    });
+});
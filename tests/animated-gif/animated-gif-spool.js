@@ -0,0 +1,53 @@
+var GifLib = require('../../build/Release/gif');
+var fs = require('fs');
+var temp = require('temp');
+var assert = require('assert');
+var frames = require('./frames');
+
+// Fragments kept in memory, spilled to the spool file and spilled deflated
+// must all give the same file.
+
+var pushedBytes = 0;
+frames.load().forEach(function (fragments) {
+    fragments.forEach(function (f) {
+        pushedBytes += f.rgb.length;
+    });
+});
+
+function encode(memoryBudget, compression, outputFile, done) {
+    var animatedGif = new GifLib.AsyncAnimatedGif(720, 400);
+    animatedGif.setOutputFile(outputFile);
+    animatedGif.setTmpDir(temp.mkdirSync());
+    if (memoryBudget !== undefined)
+        animatedGif.setMemoryBudget(memoryBudget);
+    animatedGif.setCompression(compression);
+    frames.push(animatedGif);
+
+    animatedGif.encode(function (status, error) {
+        if (!status) throw error;
+        var stats = animatedGif.getSpoolStats();
+        assert.equal(stats.pushedBytes, pushedBytes);
+        assert.equal(stats.memoryBytes, 0, 'fragments not freed');
+        done(stats, fs.readFileSync(outputFile));
+    });
+}
+
+encode(undefined, 0, 'animated-spool-memory.gif', function (memoryStats, memory) {
+    assert.equal(memoryStats.spilledBytes, 0);
+    // a byte per pixel
+    assert.equal(memoryStats.storedBytes, pushedBytes/3);
+
+    encode(0, 0, 'animated-spool-spilled.gif', function (fileStats, file) {
+        assert.equal(fileStats.spilledBytes, fileStats.storedBytes);
+        assert.equal(fileStats.storedBytes, memoryStats.storedBytes);
+        assert.equal(file.toString('base64'), memory.toString('base64'));
+
+        encode(0, 1, 'animated-spool-deflated.gif', function (deflatedStats, deflated) {
+            assert.equal(deflatedStats.spilledBytes, deflatedStats.storedBytes);
+            assert.ok(deflatedStats.storedBytes < fileStats.storedBytes,
+                deflatedStats.storedBytes + ' bytes deflated');
+            assert.equal(deflated.toString('base64'), memory.toString('base64'));
+            console.log('spooled output matches, ' + memory.length + ' bytes');
+        });
+    });
+});
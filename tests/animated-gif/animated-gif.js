@@ -42,3 +42,8 @@ var gif = animatedGif.getGif();
 
 fs.writeFileSync('animated.gif', gif.toString('binary'), 'binary');
 
+
+var stats = animatedGif.getStats();
+console.log(gif.length + ' bytes, ' + stats.croppedFrames + ' cropped frames, ' +
+    stats.outputAllocs + ' allocations, ' +
+    stats.outputBytesCopied + ' bytes copied');
@@ -0,0 +1,37 @@
+var fs = require('fs');
+var path = require('path');
+
+// The recorded frames live in numbered directories, one per frame, each
+// holding the fragments pushed for it as <n>-rgb-<x>-<y>-<w>-<h>.dat.
+// Returns them as a list of frames, each a list of {rgb, x, y, w, h}.
+exports.load = function () {
+    var dirs = fs.readdirSync(__dirname).sort().filter(function (f) {
+        return /^\d+$/.test(f);
+    });
+    return dirs.map(function (dir) {
+        var fragments = [];
+        fs.readdirSync(path.join(__dirname, dir)).sort().forEach(function (file) {
+            var m = file.match(/^\d+-rgb-(\d+)-(\d+)-(\d+)-(\d+)\.dat$/);
+            if (!m)
+                return;
+            fragments.push({
+                rgb: fs.readFileSync(path.join(__dirname, dir, file)),
+                x: parseInt(m[1], 10),
+                y: parseInt(m[2], 10),
+                w: parseInt(m[3], 10),
+                h: parseInt(m[4], 10)
+            });
+        });
+        return fragments;
+    });
+};
+
+// Pushes every frame to gif, an AnimatedGif or an AsyncAnimatedGif.
+exports.push = function (gif) {
+    exports.load().forEach(function (fragments) {
+        fragments.forEach(function (f) {
+            gif.push(f.rgb, f.x, f.y, f.w, f.h);
+        });
+        gif.endPush();
+    });
+};
@@ -0,0 +1,96 @@
+var GifLib = require('../build/Release/gif');
+var fs = require('fs');
+var Buffer = require('buffer').Buffer;
+var assert = require('assert');
+var reader = require('./gif-reader');
+
+var gifStack = new GifLib.DynamicGifStack('rgba');
+gifStack.setSparse(true);
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgba-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+function rects(gif) {
+    return gif.images.map(function (image) {
+        return [image.x, image.y, image.width, image.height].join(',');
+    });
+}
+
+var files = fs.readdirSync('./push-data');
+
+files.forEach(function(file) {
+    var dim = rectDim(file);
+    var rgba = fs.readFileSync('./push-data/' + file);
+    gifStack.push(rgba, dim.x, dim.y, dim.w, dim.h);
+});
+
+// Updates that overlap or lie close together become a single image, the
+// recorded terminal updates all do. Far apart ones get images of their
+// own, and both draw the same picture the canvas does.
+function solid(w, h, r, g, b) {
+    var buf = new Buffer(w*h*4);
+    for (var i = 0; i < w*h; i++) {
+        buf[i*4] = r;
+        buf[i*4 + 1] = g;
+        buf[i*4 + 2] = b;
+        buf[i*4 + 3] = 0xff;
+    }
+    return buf;
+}
+
+function spreadOut(stack) {
+    stack.push(solid(16, 16, 0xcc, 0, 0), 0, 0, 16, 16);
+    stack.push(solid(16, 16, 0, 0xcc, 0), 8, 8, 16, 16);
+    stack.push(solid(20, 10, 0, 0, 0xcc), 300, 200, 20, 10);
+    stack.push(solid(1, 1, 0, 0, 0), 50, 50, 0, 0);
+}
+
+var sparse = new GifLib.DynamicGifStack('rgba');
+sparse.setSparse(true);
+spreadOut(sparse);
+var canvas = new GifLib.DynamicGifStack('rgba');
+spreadOut(canvas);
+
+var sparseGif = reader.decode(sparse.encodeSync());
+assert.equal(sparseGif.width, 320);
+assert.equal(sparseGif.height, 210);
+assert.deepEqual(rects(sparseGif), ['0,0,24,24', '300,200,20,10']);
+var canvasGif = reader.decode(canvas.encodeSync());
+assert.equal(reader.render(sparseGif).toString('hex'), reader.render(canvasGif).toString('hex'));
+
+// nothing but empty updates leave a transparent screen, without any there
+// is nothing to encode
+var blank = new GifLib.DynamicGifStack('rgba');
+blank.setSparse(true);
+blank.push(solid(1, 1, 0, 0, 0), 5, 5, 4, 0);
+blank.push(solid(1, 1, 0, 0, 0), 5, 5, 0, 4);
+var blankGif = reader.decode(blank.encodeSync());
+assert.deepEqual(rects(blankGif), ['0,0,1,1']);
+assert.equal(blankGif.images[0].pixels[0], blankGif.images[0].transparent);
+
+var empty = new GifLib.DynamicGifStack('rgba');
+empty.setSparse(true);
+assert.throws(function () {
+    empty.encodeSync();
+}, /Nothing to encode/);
+
+gifStack.encode(function (gif, dims, error) {
+    if (error) throw error;
+    fs.writeFileSync('dynamic-sparse.gif', gif.toString('binary'), 'binary');
+    console.log("Sparse GIF located at (" + dims.x + "," + dims.y + ") with width " +
+        dims.width + " and height " + dims.height + ", " + gif.length + " bytes");
+
+    var decoded = reader.decode(gif);
+    assert.equal(decoded.width, dims.width);
+    assert.equal(decoded.height, dims.height);
+    assert.deepEqual(rects(decoded), ['0,0,112,13']);
+
+    empty.encode(function (gif, dims, error) {
+        assert.ok(/Nothing to encode/.test(error.message), error);
+    });
+});
@@ -0,0 +1,40 @@
+var assert = require('assert');
+var fs  = require('fs');
+var GifLib = require('../build/Release/gif');
+
+// Repeated encodes should reuse the pooled encoder contexts.
+
+var terminal = fs.readFileSync('./terminal.rgba');
+
+GifLib.reserveEncoderContexts(1, 720, 400);
+var before = GifLib.getEncoderContextStats();
+
+var start = Date.now();
+for (var i = 0; i < 1000; i++) {
+    var gif = new GifLib.Gif(terminal, 720, 400, 'rgba');
+    gif.setPalette(i % 2 ? 'adaptive' : 'websafe');
+    gif.encodeSync();
+}
+console.log('1000 encodes: ' + (Date.now() - start) + 'ms');
+
+var after = GifLib.getEncoderContextStats();
+assert.equal(after.misses, before.misses, 'encodes allocated new contexts');
+assert.equal(after.hits - before.hits, 1000);
+console.log(after);
+
+// Reserving fewer contexts frees the rest, none empties the pool.
+GifLib.reserveEncoderContexts(3, 720, 400);
+assert.equal(GifLib.getEncoderContextStats().idle, 3);
+GifLib.reserveEncoderContexts(1, 720, 400);
+assert.equal(GifLib.getEncoderContextStats().idle, 1);
+GifLib.reserveEncoderContexts(0, 0, 0);
+var emptied = GifLib.getEncoderContextStats();
+assert.equal(emptied.idle, 0);
+assert.equal(emptied.idleBytes, 0);
+
+// contexts grown past the memory the pool keeps are freed, not kept
+assert.throws(function () {
+    GifLib.reserveEncoderContexts(64, 4000, 4000);
+}, /MB the pool keeps/);
+assert.ok(GifLib.getEncoderContextStats().idleBytes <= 256*1024*1024);
+GifLib.reserveEncoderContexts(0, 0, 0);
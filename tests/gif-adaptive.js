@@ -0,0 +1,48 @@
+var assert = require('assert');
+var fs  = require('fs');
+var Gif = require('../build/Release/gif').Gif;
+var Buffer = require('buffer').Buffer;
+var reader = require('./gif-reader');
+
+// An adaptive palette must keep the colors of an image that has few of
+// them, and get closer than the web safe palette to one that has many.
+
+function encode(buf, width, height, type, palette) {
+    var gif = new Gif(buf, width, height, type);
+    gif.setPalette(palette);
+    return gif.encodeSync();
+}
+
+// mean squared error of the decoded gif against the input, per channel
+function mse(gif, buf, bpp) {
+    var screen = reader.render(reader.decode(gif));
+    var error = 0, n = buf.length/bpp;
+    for (var i = 0; i < n; i++) {
+        for (var c = 0; c < 3; c++) {
+            var d = screen[i*4 + c] - buf[i*bpp + c];
+            error += d*d;
+        }
+    }
+    return error/(n*3);
+}
+
+var terminal = fs.readFileSync('./terminal.rgba');
+var websafe = encode(terminal, 720, 400, 'rgba', 'websafe');
+var adaptive = encode(terminal, 720, 400, 'rgba', 'adaptive');
+console.log('terminal websafe: ' + websafe.length + ' bytes, adaptive: ' + adaptive.length + ' bytes');
+assert.equal(mse(adaptive, terminal, 4), 0, 'terminal colors changed');
+
+var width = 256, height = 256;
+var gradient = new Buffer(width*height*3);
+for (var y = 0; y < height; y++) {
+    for (var x = 0; x < width; x++) {
+        var i = (y*width + x)*3;
+        gradient[i] = x;
+        gradient[i + 1] = y;
+        gradient[i + 2] = (x + y)/2;
+    }
+}
+var websafeError = mse(encode(gradient, width, height, 'rgb', 'websafe'), gradient, 3);
+var adaptiveError = mse(encode(gradient, width, height, 'rgb', 'adaptive'), gradient, 3);
+console.log('gradient MSE websafe: ' + websafeError.toFixed(1) + ', adaptive: ' + adaptiveError.toFixed(1));
+assert.ok(adaptiveError < websafeError, 'adaptive palette is no closer than web safe');
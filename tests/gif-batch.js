@@ -0,0 +1,34 @@
+var assert = require('assert');
+var Gif = require('../build/Release/gif').Gif;
+var Buffer = require('buffer').Buffer;
+
+// Encodes a batch of sprites and checks each against encodeSync.
+
+var images = [];
+for (var i = 0; i < 200; i++) {
+    var size = 8 + i%25;
+    var buf = new Buffer(size*size*4);
+    for (var j = 0; j < size*size; j++) {
+        buf[j*4] = (i*13 + j) & 0xff;
+        buf[j*4 + 1] = (i*7) & 0xff;
+        buf[j*4 + 2] = j & 0xff;
+        buf[j*4 + 3] = 0xff;
+    }
+    images.push({ buffer: buf, width: size, height: size, type: 'rgba' });
+}
+
+var start = Date.now();
+Gif.encodeBatch(images, function (gifs, err) {
+    assert.ifError(err);
+    console.log(images.length + ' images: ' + (Date.now() - start) + 'ms');
+    assert.equal(gifs.length, images.length);
+    images.forEach(function (image, i) {
+        var expected = new Gif(image.buffer, image.width, image.height, image.type).encodeSync();
+        assert.equal(gifs[i].toString('hex'), expected.toString('hex'), 'image ' + i + ' differs');
+    });
+});
+
+// images without pixels are refused up front
+assert.throws(function () {
+    Gif.encodeBatch([{ buffer: new Buffer(0), width: 0, height: 16 }], function () {});
+}, TypeError);
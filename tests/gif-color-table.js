@@ -0,0 +1,42 @@
+var assert = require('assert');
+var Gif = require('../build/Release/gif').Gif;
+var Buffer = require('buffer').Buffer;
+var reader = require('./gif-reader');
+
+// An image that ends up using 40 web safe colors gets a 64-entry table.
+// It has too many colors of its own to be kept as they are, each pixel is
+// one of 40 colors with a bit of noise that quantization takes away. Black
+// is left out, with noise it could as well be one of the palette's grays.
+
+function webSafe(color) {
+    return [(color%6)*51, Math.floor(color/6)%6*51, Math.floor(color/36)*51];
+}
+
+var width = 320, height = 200;
+var buf = new Buffer(width*height*3);
+var seed = 1;
+for (var i = 0; i < width*height; i++) {
+    var levels = webSafe(1 + i%40);
+    for (var c = 0; c < 3; c++) {
+        seed = (seed*69069 + 1)%4294967296;
+        var noise = (seed >>> 24)%21 - 10;
+        buf[i*3 + c] = Math.min(255, Math.max(0, levels[c] + noise));
+    }
+}
+
+var gif = reader.decode(new Gif(buf, width, height, 'rgb').encodeSync());
+assert.equal(gif.colors.length, 64);
+
+var used = {};
+var image = gif.images[0];
+for (var i = 0; i < image.pixels.length; i++)
+    used[image.pixels[i]] = true;
+assert.equal(Object.keys(used).length, 40);
+
+// every pixel still shows the web safe color it was made from
+var screen = reader.render(gif);
+for (var i = 0; i < width*height; i++) {
+    var levels = webSafe(1 + i%40);
+    for (var c = 0; c < 3; c++)
+        assert.equal(screen[i*4 + c], levels[c]);
+}
@@ -0,0 +1,178 @@
+// Just enough of a GIF decoder for the tests to look at what the encoders
+// wrote: the screen, every image with its color table, transparency and
+// delay, and the pixels drawn on the screen.
+
+function readColors(buf, pos, count) {
+    var colors = [];
+    for (var i = 0; i < count; i++, pos += 3)
+        colors.push([buf[pos], buf[pos + 1], buf[pos + 2]]);
+    return colors;
+}
+
+function readBlocks(buf, pos) {
+    var chunks = [];
+    while (buf[pos] != 0) {
+        chunks.push(buf.slice(pos + 1, pos + 1 + buf[pos]));
+        pos += buf[pos] + 1;
+    }
+    return { data: Buffer.concat(chunks), end: pos + 1 };
+}
+
+function lzwDecode(data, minCodeSize, pixels) {
+    var out = new Buffer(pixels);
+    var n = 0;
+    var clear = 1 << minCodeSize, eoi = clear + 1;
+    var prefix = [], suffix = [], first = [];
+    var next, size, prev = -1;
+    var bitPos = 0, totalBits = data.length*8;
+
+    function reset() {
+        next = eoi + 1;
+        size = minCodeSize + 1;
+        prev = -1;
+    }
+    function emit(code) {
+        var stack = [];
+        while (code > eoi) {
+            stack.push(suffix[code]);
+            code = prefix[code];
+        }
+        stack.push(code);
+        for (var i = stack.length - 1; i >= 0; i--) {
+            if (n >= pixels) throw new Error('too much image data');
+            out[n++] = stack[i];
+        }
+    }
+
+    for (var i = 0; i < clear; i++)
+        first[i] = i;
+    reset();
+    while (bitPos + size <= totalBits) {
+        var code = 0;
+        for (var b = 0; b < size; b++, bitPos++)
+            code |= ((data[bitPos >> 3] >> (bitPos & 7)) & 1) << b;
+
+        if (code == clear) {
+            reset();
+            continue;
+        }
+        if (code == eoi)
+            break;
+
+        if (prev == -1) {
+            emit(code);
+        }
+        else {
+            var known = code < next;
+            if (!known && code != next)
+                throw new Error('bad LZW code ' + code);
+            var f = known ? first[code] : first[prev];
+            if (next < 4096) {
+                prefix[next] = prev;
+                suffix[next] = f;
+                first[next] = first[prev];
+                next++;
+            }
+            emit(code);
+            if (next == 1 << size && size < 12)
+                size++;
+        }
+        prev = code;
+    }
+    if (n != pixels)
+        throw new Error('image data has ' + n + ' pixels instead of ' + pixels);
+    return out;
+}
+
+// Returns { width, height, colors, images }, colors being the global color
+// table or null. Every image has x, y, width, height, colors (its local
+// table or null), transparent (index or -1), delay and pixels (indices).
+exports.decode = function (buf) {
+    if (buf.slice(0, 6).toString() != 'GIF89a' && buf.slice(0, 6).toString() != 'GIF87a')
+        throw new Error('not a gif');
+
+    var gif = {
+        width: buf.readUInt16LE(6),
+        height: buf.readUInt16LE(8),
+        colors: null,
+        images: []
+    };
+    var flags = buf[10];
+    var pos = 13;
+    if (flags & 0x80) {
+        gif.colors = readColors(buf, pos, 2 << (flags & 7));
+        pos += gif.colors.length*3;
+    }
+
+    var transparent = -1, delay = 0;
+    for (;;) {
+        var type = buf[pos++];
+        if (type == 0x3b) // trailer
+            break;
+
+        if (type == 0x21) {
+            var label = buf[pos++];
+            var blocks = readBlocks(buf, pos);
+            if (label == 0xf9) {
+                transparent = blocks.data[0] & 1 ? blocks.data[3] : -1;
+                delay = blocks.data.readUInt16LE(1);
+            }
+            pos = blocks.end;
+            continue;
+        }
+
+        if (type != 0x2c)
+            throw new Error('unexpected block 0x' + type.toString(16) + ' at ' + (pos - 1));
+
+        var image = {
+            x: buf.readUInt16LE(pos),
+            y: buf.readUInt16LE(pos + 2),
+            width: buf.readUInt16LE(pos + 4),
+            height: buf.readUInt16LE(pos + 6),
+            colors: null,
+            transparent: transparent,
+            delay: delay
+        };
+        flags = buf[pos + 8];
+        pos += 9;
+        if (flags & 0x80) {
+            image.colors = readColors(buf, pos, 2 << (flags & 7));
+            pos += image.colors.length*3;
+        }
+        var minCodeSize = buf[pos++];
+        var data = readBlocks(buf, pos);
+        pos = data.end;
+        image.pixels = lzwDecode(data.data, minCodeSize, image.width*image.height);
+        gif.images.push(image);
+        transparent = -1;
+        delay = 0;
+    }
+    return gif;
+};
+
+// Draws the first count images (all of them by default) on an RGBA screen,
+// 0 alpha where nothing was drawn, the way frames that are never disposed
+// pile up.
+exports.render = function (gif, count) {
+    if (count === undefined)
+        count = gif.images.length;
+    var screen = new Buffer(gif.width*gif.height*4);
+    screen.fill(0);
+    for (var i = 0; i < count; i++) {
+        var image = gif.images[i];
+        var colors = image.colors || gif.colors;
+        for (var y = 0; y < image.height; y++) {
+            for (var x = 0; x < image.width; x++) {
+                var idx = image.pixels[y*image.width + x];
+                if (idx == image.transparent)
+                    continue;
+                var p = ((image.y + y)*gif.width + image.x + x)*4;
+                screen[p] = colors[idx][0];
+                screen[p + 1] = colors[idx][1];
+                screen[p + 2] = colors[idx][2];
+                screen[p + 3] = 0xff;
+            }
+        }
+    }
+    return screen;
+};
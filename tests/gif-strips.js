@@ -0,0 +1,41 @@
+var assert = require('assert');
+var fs  = require('fs');
+var Gif = require('../build/Release/gif').Gif;
+var Buffer = require('buffer').Buffer;
+var reader = require('./gif-reader');
+
+// Encodes a wide image as one image and as strips, and checks that the
+// strips show the same pixels and that their output doesn't change from
+// run to run.
+
+var width = 7680, height = 1080;
+var buf = new Buffer(width*height*3);
+for (var y = 0; y < height; y++) {
+    for (var x = 0; x < width; x++) {
+        var i = (y*width + x)*3;
+        buf[i] = x & 0xff;
+        buf[i + 1] = y & 0xff;
+        buf[i + 2] = (x >> 5) ^ (y >> 3);
+    }
+}
+
+function encode(strips) {
+    var gif = new Gif(buf, width, height, 'rgb');
+    gif.setStrips(strips);
+    var start = Date.now();
+    var image = gif.encodeSync();
+    console.log(strips + ' strips: ' + (Date.now() - start) + 'ms, ' + image.length + ' bytes');
+    return image;
+}
+
+var single = reader.decode(encode(1));
+var strips = encode(8);
+assert.equal(encode(8).toString('hex'), strips.toString('hex'), 'strip output differs between runs');
+
+var decoded = reader.decode(strips);
+assert.equal(single.images.length, 1);
+assert.equal(decoded.images.length, 8);
+assert.equal(reader.render(decoded).toString('hex'), reader.render(single).toString('hex'),
+    'strips show different pixels');
+
+fs.writeFileSync('./gif-strips.gif', strips.toString('binary'), 'binary');
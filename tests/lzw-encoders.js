@@ -0,0 +1,51 @@
+var assert = require('assert');
+var fs  = require('fs');
+var GifLib = require('../build/Release/gif');
+
+// The native LZW encoder must produce the same bytes as giflib's.
+
+var terminal = fs.readFileSync('./terminal.rgba');
+
+function encode(palette) {
+    var gif = new GifLib.Gif(terminal, 720, 400, 'rgba');
+    gif.setPalette(palette);
+    return gif.encodeSync();
+}
+
+function encodeAnimated() {
+    var gif = new GifLib.AnimatedGif(720, 400);
+    gif.setPalette('adaptive');
+    ['01', '02', '03'].forEach(function (dir) {
+        fs.readdirSync('./animated-gif/' + dir).sort().forEach(function (file) {
+            var m = file.match(/^\d+-rgb-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+            gif.push(fs.readFileSync('./animated-gif/' + dir + '/' + file),
+                +m[1], +m[2], +m[3], +m[4]);
+        });
+        gif.endPush();
+    });
+    return gif.end();
+}
+
+var cases = {
+    websafe: function () { return encode('websafe'); },
+    adaptive: function () { return encode('adaptive'); },
+    animated: encodeAnimated
+};
+
+Object.keys(cases).forEach(function (name) {
+    GifLib.setLzwEncoder('giflib');
+    var start = Date.now();
+    var expected = cases[name]();
+    var giflib = Date.now() - start;
+
+    GifLib.setLzwEncoder('native');
+    start = Date.now();
+    var gif = cases[name]();
+    var native = Date.now() - start;
+
+    assert.equal(gif.toString('hex'), expected.toString('hex'),
+        'native LZW differs from giflib on ' + name);
+    console.log(name + ': giflib ' + giflib + 'ms, native ' + native + 'ms');
+});
+
+console.log('LZW encoders match, using ' + GifLib.getLzwEncoder());
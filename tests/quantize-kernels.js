@@ -0,0 +1,67 @@
+var assert = require('assert');
+var GifLib = require('../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+
+// Every quantization kernel must produce the same bytes as the reference
+// nearest-color search.
+
+// Images with 256 colors or fewer, like terminal.rgba, skip the kernels
+// for an exact palette, so the images here all have more.
+
+function noise(width, height) {
+    var buf = new Buffer(width*height*4);
+    var seed = 1;
+    for (var i = 0; i < buf.length; i++) {
+        seed = (seed*69069 + 1) % 4294967296;
+        buf[i] = i%4 == 3 ? 0xff : seed >>> 24;
+    }
+    return buf;
+}
+
+function gradient(width, height, type) {
+    var bpp = type.length;
+    var buf = new Buffer(width*height*bpp);
+    for (var y = 0; y < height; y++) {
+        for (var x = 0; x < width; x++) {
+            var rgb = { r: x, g: y, b: (x*7 + y*13) & 0xff };
+            for (var i = 0; i < bpp; i++) {
+                var c = type[i];
+                buf[(y*width + x)*bpp + i] = c == 'a' ? 0xff : rgb[c];
+            }
+        }
+    }
+    return buf;
+}
+
+var images = [
+    { name: 'noise', buf: noise(720, 400), width: 720, height: 400, type: 'rgba' }
+];
+['rgb', 'bgr', 'rgba', 'bgra'].forEach(function (type) {
+    images.push({ name: 'gradient-' + type, buf: gradient(255, 257, type),
+        width: 255, height: 257, type: type });
+});
+
+function encode(image) {
+    return new GifLib.Gif(image.buf, image.width, image.height, image.type).encodeSync();
+}
+
+images.forEach(function (image) {
+    GifLib.setQuantizeKernel('reference');
+    var expected = encode(image);
+
+    ['scalar', 'sse2', 'avx2'].forEach(function (kernel) {
+        if (!GifLib.setQuantizeKernel(kernel)) {
+            console.log(kernel + ' not supported, skipping');
+            return;
+        }
+        var start = Date.now();
+        var gif = encode(image);
+        assert.equal(gif.toString('hex'), expected.toString('hex'),
+            kernel + ' differs from reference on ' + image.name);
+        console.log(image.name + ' ' + kernel + ': ' + (Date.now() - start) + 'ms');
+    });
+});
+
+GifLib.setQuantizeKernel('auto');
+console.log('all kernels match, using ' + GifLib.getQuantizeKernel());
+
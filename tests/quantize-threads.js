@@ -0,0 +1,58 @@
+var assert = require('assert');
+var GifLib = require('../build/Release/gif');
+var Buffer = require('buffer').Buffer;
+
+// Quantizing on several threads must not change the output.
+
+var width = 3840, height = 2160;
+var buf = new Buffer(width*height*4);
+for (var i = 0; i < width*height; i++) {
+    buf[i*4] = i & 0xff;
+    buf[i*4 + 1] = (i >> 8) & 0xff;
+    buf[i*4 + 2] = (i*7) & 0xff;
+    buf[i*4 + 3] = 0xff;
+}
+
+function encodeGif() {
+    return new GifLib.Gif(buf, width, height, 'rgba').encodeSync();
+}
+
+function encodeAnimated() {
+    var gif = new GifLib.AnimatedGif(width, height, 'rgba');
+    gif.push(buf, 0, 0, width, height);
+    gif.endPush();
+    gif.push(buf.slice(0, width*4*100), 0, 0, width, 100);
+    gif.endPush();
+    return gif.end();
+}
+
+[encodeGif, encodeAnimated].forEach(function (encode) {
+    GifLib.setQuantizeThreads(1);
+    var start = Date.now();
+    var expected = encode();
+    console.log(encode.name + ' 1 thread: ' + (Date.now() - start) + 'ms');
+
+    [2, 4, 8].forEach(function (threads) {
+        GifLib.setQuantizeThreads(threads);
+        start = Date.now();
+        var gif = encode();
+        assert.equal(gif.toString('hex'), expected.toString('hex'),
+            encode.name + ' differs with ' + threads + ' threads');
+        console.log(encode.name + ' ' + threads + ' threads: ' + (Date.now() - start) + 'ms');
+    });
+});
+
+// Images without pixels are refused before the quantizer gets to split
+// their rows into bands.
+GifLib.setQuantizeThreads(4);
+assert.throws(function () {
+    new GifLib.Gif(new Buffer(0), 0, 16, 'rgb').encodeSync();
+}, RangeError);
+assert.throws(function () {
+    new GifLib.Gif(new Buffer(0), 16, 0, 'rgb').encodeSync();
+}, RangeError);
+assert.throws(function () {
+    new GifLib.AnimatedGif(0, 16);
+}, RangeError);
+
+GifLib.setQuantizeThreads(1);